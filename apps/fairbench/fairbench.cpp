@@ -0,0 +1,98 @@
+#include <cstdio>
+#include <cstdlib>
+#include "../syscall.h"
+
+// N threads spin for a while, then their CPU time since the start is compared
+// with the same nice value, a fair scheduler gives each the same share
+const int kMaxThreads = 32;
+const size_t kStackBytes = 16 * 1024;
+const size_t kMaxStats = 512;
+
+volatile bool stop = false;
+TaskStat stats[kMaxStats];
+
+void Spin(int, void* arg) {
+  SyscallSetNice(reinterpret_cast<intptr_t>(arg));
+  while (!stop) {
+  }
+  SyscallExit(0);
+}
+
+// run time (ns) of each thread in ids
+void RunTimes(const uint64_t* ids, int n, uint64_t* run_ns) {
+  const size_t num_stats = SyscallTaskStat(stats, kMaxStats).value;
+  for (int i = 0; i < n; ++i) {
+    run_ns[i] = 0;
+    for (size_t j = 0; j < num_stats; ++j) {
+      if (stats[j].id == ids[i]) {
+        run_ns[i] = stats[j].run_ns;
+      }
+    }
+  }
+}
+
+void Sleep(unsigned long ms) {
+  SyscallCreateTimer(TIMER_ONESHOT_REL, 1, ms);
+  AppEvent events[1];
+  while (true) {
+    SyscallReadEvent(events, 1);
+    if (events[0].type == AppEvent::kTimerTimeout) {
+      return;
+    }
+  }
+}
+
+extern "C" void main(int argc, char** argv) {
+  if (argc <= 1) {
+    printf("Usage: fairbench <threads> [seconds] [nice step]\n");
+    exit(1);
+  }
+  const int n = atoi(argv[1]);
+  const int seconds = argc >= 3 ? atoi(argv[2]) : 5;
+  const int nice_step = argc >= 4 ? atoi(argv[3]) : 0;
+  if (n < 1 || kMaxThreads < n || seconds < 1) {
+    printf("threads must be 1 .. %d, seconds must be positive\n", kMaxThreads);
+    exit(1);
+  }
+
+  uint64_t ids[kMaxThreads];
+  int nices[kMaxThreads];
+  for (int i = 0; i < n; ++i) {
+    nices[i] = nice_step * i > 19 ? 19 : nice_step * i;
+    auto stack = reinterpret_cast<char*>(malloc(kStackBytes));
+    auto res = SyscallThreadCreate(Spin, reinterpret_cast<void*>(nices[i]), stack + kStackBytes);
+    if (res.error) {
+      printf("failed to create a thread: %d\n", res.error);
+      exit(1);
+    }
+    ids[i] = res.value;
+  }
+
+  uint64_t start_ns[kMaxThreads], end_ns[kMaxThreads];
+  RunTimes(ids, n, start_ns);
+  Sleep(seconds * 1000);
+  RunTimes(ids, n, end_ns);
+  stop = true;
+  for (int i = 0; i < n; ++i) {
+    SyscallThreadJoin(ids[i]);
+  }
+
+  uint64_t total = 0, min_run = UINT64_MAX, max_run = 0;
+  for (int i = 0; i < n; ++i) {
+    const uint64_t run = end_ns[i] - start_ns[i];
+    total += run;
+    min_run = run < min_run ? run : min_run;
+    max_run = run > max_run ? run : max_run;
+  }
+  for (int i = 0; i < n; ++i) {
+    const uint64_t run = end_ns[i] - start_ns[i];
+    const uint64_t permil = total > 0 ? run * 1000 / total : 0;
+    printf("thread %2d nice %3d: %6lu ms, %3lu.%lu%%\n",
+           i, nices[i], run / 1000000, permil / 10, permil % 10);
+  }
+  // spread of the shares: (max - min) / mean
+  const uint64_t mean = total / n;
+  const uint64_t spread = mean > 0 ? (max_run - min_run) * 1000 / mean : 0;
+  printf("spread (max - min) / mean: %lu.%lu%%\n", spread / 10, spread % 10);
+  exit(0);
+}
@@ -0,0 +1,82 @@
+#include <cstdio>
+#include <cstdlib>
+#include "../syscall.h"
+
+// touch every page of a demand-paged region, once mapped with 2 MiB pages and
+// once with 4 KiB pages, and compare the page faults and the time
+const size_t kMaxStats = 512;
+const size_t kPagesPerMiB = 256;
+
+TaskStat before[kMaxStats], after[kMaxStats];
+
+// page faults taken by this app between the two snapshots
+// the app does not know its task ID, so take the task whose count grew most
+uint64_t FaultsBetween(size_t num_before, size_t num_after) {
+  uint64_t max_faults = 0;
+  for (size_t i = 0; i < num_after; ++i) {
+    uint64_t faults = after[i].page_faults;
+    for (size_t j = 0; j < num_before; ++j) {
+      if (before[j].id == after[i].id) {
+        faults -= before[j].page_faults;
+      }
+    }
+    max_faults = faults > max_faults ? faults : max_faults;
+  }
+  return max_faults;
+}
+
+void Touch(volatile char* p, size_t num_pages) {
+  for (size_t i = 0; i < num_pages; ++i) {
+    p[i * 4096] = 1;
+  }
+}
+
+// the whole region is requested at once, so its 2 MiB blocks are mapped with 2 MiB pages
+void RunHuge(size_t mib) {
+  const size_t num_before = SyscallTaskStat(before, kMaxStats).value;
+  const uint64_t start = SyscallClockGetTime().value;
+  auto res = SyscallDemandPages(mib * kPagesPerMiB, 0);
+  if (res.error) {
+    printf("failed to get pages: %d\n", res.error);
+    exit(1);
+  }
+  Touch(reinterpret_cast<char*>(res.value), mib * kPagesPerMiB);
+  const uint64_t elapsed = SyscallClockGetTime().value - start;
+  const size_t num_after = SyscallTaskStat(after, kMaxStats).value;
+  printf("2 MiB pages: %lu faults, %lu us\n", FaultsBetween(num_before, num_after), elapsed / 1000);
+}
+
+// the region grows 1 MiB at a time and each part is touched before the next one is requested,
+// so no 2 MiB block is inside the region when its first page faults
+void RunSmall(size_t mib) {
+  const size_t num_before = SyscallTaskStat(before, kMaxStats).value;
+  const uint64_t start = SyscallClockGetTime().value;
+  for (size_t i = 0; i < mib; ++i) {
+    auto res = SyscallDemandPages(kPagesPerMiB, 0);
+    if (res.error) {
+      printf("failed to get pages: %d\n", res.error);
+      exit(1);
+    }
+    Touch(reinterpret_cast<char*>(res.value), kPagesPerMiB);
+  }
+  const uint64_t elapsed = SyscallClockGetTime().value - start;
+  const size_t num_after = SyscallTaskStat(after, kMaxStats).value;
+  printf("4 KiB pages: %lu faults, %lu us\n", FaultsBetween(num_before, num_after), elapsed / 1000);
+}
+
+extern "C" void main(int argc, char** argv) {
+  size_t mib = 64;
+  if (argc >= 2) {
+    mib = strtoul(argv[1], nullptr, 0);
+  }
+  if (mib < 2 || mib % 2) {
+    printf("size must be a positive multiple of 2 MiB\n");
+    exit(1);
+  }
+
+  printf("touching %lu MiB\n", mib);
+  // 2 MiB pages first: the region then ends at a 2 MiB boundary for the 4 KiB run
+  RunHuge(mib);
+  RunSmall(mib);
+  exit(0);
+}
@@ -16,6 +16,8 @@ extern "C" void main(int argc, char** argv) {
   }
 
   char* p = reinterpret_cast<char*>(res.value);
+  // the file is read from the head to the tail
+  SyscallMAdvise(p, file_size, MADV_SEQUENTIAL);
 
   for (size_t i = 0; i < file_size; ++i) {
     printf("%c", p[i]);
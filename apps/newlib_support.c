@@ -1,8 +1,20 @@
 #include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <sys/types.h>
+#include <time.h>
 
+#include "pthread.h"
 #include "syscall.h"
 
+int clock_gettime(clockid_t clock_id, struct timespec* tp) {
+  // every clock is the monotonic time since the boot
+  struct SyscallResult res = SyscallClockGetTime();
+  tp->tv_sec = res.value / 1000000000;
+  tp->tv_nsec = res.value % 1000000000;
+  return 0;
+}
+
 int close(int fd) {
   errno = EBADF;
   return -1;
@@ -91,4 +103,212 @@ ssize_t write(int fd, const void* buf, size_t count) {
 
 void _exit(int status) {
   SyscallExit(status);
+}
+
+#define PTHREAD_DEFAULT_STACK_SIZE (64 * 1024)
+#define PTHREAD_MAX_THREADS 64
+
+struct pthread {
+  uint64_t id; // task ID (0 for the main thread)
+  void* (*start_routine)(void*);
+  void* arg;
+  void* retval;
+  char* stack;
+  size_t stack_size;
+};
+
+static struct pthread main_thread;
+static struct pthread* threads[PTHREAD_MAX_THREADS];
+static pthread_mutex_t threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void StartThread(int unused, void* arg) {
+  struct pthread* th = arg;
+  th->retval = th->start_routine(th->arg);
+  SyscallExit(0);
+}
+
+int pthread_create(pthread_t* thread, const pthread_attr_t* attr,
+                   void* (*start_routine)(void*), void* arg) {
+  struct pthread* th = malloc(sizeof(struct pthread));
+  if (!th) {
+    return EAGAIN;
+  }
+  th->start_routine = start_routine;
+  th->arg = arg;
+  th->retval = NULL;
+  th->stack_size = attr && attr->stack_size ? attr->stack_size : PTHREAD_DEFAULT_STACK_SIZE;
+  th->stack = malloc(th->stack_size);
+  if (!th->stack) {
+    free(th);
+    return EAGAIN;
+  }
+
+  pthread_mutex_lock(&threads_mutex);
+  int slot = 0;
+  while (slot < PTHREAD_MAX_THREADS && threads[slot]) {
+    ++slot;
+  }
+  if (slot == PTHREAD_MAX_THREADS) {
+    pthread_mutex_unlock(&threads_mutex);
+    free(th->stack);
+    free(th);
+    return EAGAIN;
+  }
+  threads[slot] = th;
+  pthread_mutex_unlock(&threads_mutex);
+
+  struct SyscallResult res =
+    SyscallThreadCreate(StartThread, th, th->stack + th->stack_size);
+  if (res.error) {
+    threads[slot] = NULL;
+    free(th->stack);
+    free(th);
+    return EAGAIN;
+  }
+  th->id = res.value;
+  *thread = th;
+  return 0;
+}
+
+int pthread_join(pthread_t thread, void** retval) {
+  struct SyscallResult res = SyscallThreadJoin(thread->id);
+  if (res.error) {
+    return res.error;
+  }
+  if (retval) {
+    *retval = thread->retval;
+  }
+
+  pthread_mutex_lock(&threads_mutex);
+  for (int i = 0; i < PTHREAD_MAX_THREADS; ++i) {
+    if (threads[i] == thread) {
+      threads[i] = NULL;
+    }
+  }
+  pthread_mutex_unlock(&threads_mutex);
+  free(thread->stack);
+  free(thread);
+  return 0;
+}
+
+void pthread_exit(void* retval) {
+  pthread_self()->retval = retval;
+  SyscallExit(0);
+}
+
+pthread_t pthread_self(void) {
+  // threads have no thread-local storage, find the thread by its stack
+  char* sp = (char*)__builtin_frame_address(0);
+  for (int i = 0; i < PTHREAD_MAX_THREADS; ++i) {
+    struct pthread* th = threads[i];
+    if (th && th->stack <= sp && sp < th->stack + th->stack_size) {
+      return th;
+    }
+  }
+  return &main_thread;
+}
+
+int sched_yield(void) {
+  SyscallYield();
+  return 0;
+}
+
+int pthread_mutex_init(pthread_mutex_t* mutex, const pthread_mutexattr_t* attr) {
+  mutex->state = 0;
+  return 0;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t* mutex) {
+  return 0;
+}
+
+int pthread_mutex_lock(pthread_mutex_t* mutex) {
+  unsigned int s = __sync_val_compare_and_swap(&mutex->state, 0, 1);
+  if (s == 0) {
+    return 0;
+  }
+  // mark the mutex contended so that the owner wakes us up on unlock
+  if (s != 2) {
+    s = __atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE);
+  }
+  while (s != 0) {
+    SyscallFutexWait(&mutex->state, 2);
+    s = __atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE);
+  }
+  return 0;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t* mutex) {
+  return __sync_bool_compare_and_swap(&mutex->state, 0, 1) ? 0 : EBUSY;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t* mutex) {
+  if (__atomic_exchange_n(&mutex->state, 0, __ATOMIC_RELEASE) == 2) {
+    SyscallFutexWake(&mutex->state, 1);
+  }
+  return 0;
+}
+
+int pthread_cond_init(pthread_cond_t* cond, const pthread_condattr_t* attr) {
+  cond->seq = 0;
+  cond->waiters = 0;
+  return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t* cond) {
+  return 0;
+}
+
+int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+  // a signal either sees this waiter or changes seq before it is read
+  __atomic_fetch_add(&cond->waiters, 1, __ATOMIC_SEQ_CST);
+  const unsigned int seq = __atomic_load_n(&cond->seq, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(mutex);
+  SyscallFutexWait(&cond->seq, seq);
+  __atomic_fetch_sub(&cond->waiters, 1, __ATOMIC_RELAXED);
+  // other threads may be sleeping on the mutex, so do not take it as uncontended
+  while (__atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE) != 0) {
+    SyscallFutexWait(&mutex->state, 2);
+  }
+  return 0;
+}
+
+static void WakeCondWaiters(pthread_cond_t* cond, int count) {
+  __atomic_fetch_add(&cond->seq, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&cond->waiters, __ATOMIC_SEQ_CST) > 0) {
+    SyscallFutexWake(&cond->seq, count);
+  }
+}
+
+int pthread_cond_signal(pthread_cond_t* cond) {
+  WakeCondWaiters(cond, 1);
+  return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t* cond) {
+  WakeCondWaiters(cond, INT_MAX);
+  return 0;
+}
+
+// newlib calls these around malloc and free, the lock must be recursive
+static pthread_mutex_t malloc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t malloc_owner;
+static int malloc_depth;
+
+void __malloc_lock(struct _reent* r) {
+  pthread_t self = pthread_self();
+  if (malloc_depth > 0 && malloc_owner == self) {
+    ++malloc_depth;
+    return;
+  }
+  pthread_mutex_lock(&malloc_mutex);
+  malloc_owner = self;
+  malloc_depth = 1;
+}
+
+void __malloc_unlock(struct _reent* r) {
+  if (--malloc_depth == 0) {
+    malloc_owner = NULL;
+    pthread_mutex_unlock(&malloc_mutex);
+  }
 }
\ No newline at end of file
@@ -0,0 +1,58 @@
+#pragma once
+
+// minimal pthread API on SyscallThreadCreate / SyscallThreadJoin (see newlib_support.c)
+// mutexes and condition variables call SyscallFutexWait / SyscallFutexWake only when contended
+// only the default attributes are supported, pthread_exit of the main thread exits the app
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+typedef struct pthread* pthread_t;
+
+typedef struct {
+  size_t stack_size; // 0: default
+} pthread_attr_t;
+
+// 0: unlocked, 1: locked, 2: locked and some threads may sleep in SyscallFutexWait
+typedef struct {
+  volatile unsigned int state;
+} pthread_mutex_t;
+typedef int pthread_mutexattr_t;
+
+#define PTHREAD_MUTEX_INITIALIZER { 0 }
+
+// seq is incremented by every signal so that a waiter does not miss it
+// signals without waiters do not call the kernel
+typedef struct {
+  volatile unsigned int seq;
+  volatile unsigned int waiters;
+} pthread_cond_t;
+typedef int pthread_condattr_t;
+
+#define PTHREAD_COND_INITIALIZER { 0, 0 }
+
+int pthread_create(pthread_t* thread, const pthread_attr_t* attr,
+                   void* (*start_routine)(void*), void* arg);
+int pthread_join(pthread_t thread, void** retval);
+void pthread_exit(void* retval);
+pthread_t pthread_self(void);
+int sched_yield(void);
+
+int pthread_mutex_init(pthread_mutex_t* mutex, const pthread_mutexattr_t* attr);
+int pthread_mutex_destroy(pthread_mutex_t* mutex);
+int pthread_mutex_lock(pthread_mutex_t* mutex);
+int pthread_mutex_trylock(pthread_mutex_t* mutex);
+int pthread_mutex_unlock(pthread_mutex_t* mutex);
+
+int pthread_cond_init(pthread_cond_t* cond, const pthread_condattr_t* attr);
+int pthread_cond_destroy(pthread_cond_t* cond);
+int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex);
+int pthread_cond_signal(pthread_cond_t* cond);
+int pthread_cond_broadcast(pthread_cond_t* cond);
+
+#ifdef __cplusplus
+}
+#endif
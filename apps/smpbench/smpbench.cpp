@@ -0,0 +1,60 @@
+#include <cstdio>
+#include <cstdlib>
+#include "../pthread.h"
+#include "../syscall.h"
+
+// every thread does the same amount of work, so N threads on N CPUs should
+// take as long as 1 thread if the kernel runs them in parallel
+unsigned long loops = 200'000'000;
+
+void* Spin(void*) {
+  volatile unsigned long x = 0;
+  for (unsigned long i = 0; i < loops; ++i) {
+    x = x + i;
+  }
+  return nullptr;
+}
+
+// elapsed time (ns) to run n threads
+uint64_t RunThreads(int n) {
+  pthread_t threads[64];
+  const uint64_t start = SyscallClockGetTime().value;
+  for (int i = 0; i < n; ++i) {
+    if (pthread_create(&threads[i], nullptr, Spin, nullptr) != 0) {
+      printf("failed to create a thread\n");
+      exit(1);
+    }
+  }
+  for (int i = 0; i < n; ++i) {
+    pthread_join(threads[i], nullptr);
+  }
+  return SyscallClockGetTime().value - start;
+}
+
+extern "C" void main(int argc, char** argv) {
+  if (argc <= 1) {
+    printf("Usage: smpbench <threads (the number of CPUs)> [loops in millions]\n");
+    exit(1);
+  }
+  const int n = atoi(argv[1]);
+  if (n < 1 || 64 < n) {
+    printf("threads must be 1 .. 64\n");
+    exit(1);
+  }
+  if (argc >= 3) {
+    loops = strtoul(argv[2], nullptr, 0) * 1000000;
+  }
+
+  const uint64_t t1 = RunThreads(1);
+  const uint64_t tn = RunThreads(n);
+  // throughput of n threads relative to 1 thread, x100
+  const uint64_t speedup = t1 * n * 100 / tn;
+  printf("1 thread : %lu ms\n", t1 / 1000000);
+  printf("%d threads: %lu ms, speedup %lu.%02lu (ideal %d)\n",
+         n, tn / 1000000, speedup / 100, speedup % 100, n);
+
+  // near-linear: at least 80% of the ideal speedup
+  const bool pass = speedup * 10 >= static_cast<uint64_t>(n) * 100 * 8;
+  printf("%s\n", pass ? "PASS" : "FAIL");
+  exit(pass ? 0 : 1);
+}
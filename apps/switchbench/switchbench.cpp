@@ -0,0 +1,61 @@
+#include <cstdio>
+#include <cstdlib>
+#include "../pthread.h"
+#include "../syscall.h"
+
+// two threads per CPU yield to each other, so every yield is a context switch
+// the FPU variant uses SSE between the yields, so its state has to be switched too
+unsigned long yields = 100000;
+
+void* YieldInt(void*) {
+  for (unsigned long i = 0; i < yields; ++i) {
+    SyscallYield();
+  }
+  return nullptr;
+}
+
+void* YieldFPU(void*) {
+  volatile double d = 1.0;
+  for (unsigned long i = 0; i < yields; ++i) {
+    d = d * 1.000001;
+    SyscallYield();
+  }
+  return nullptr;
+}
+
+// time per context switch (ns) with n threads on cpus CPUs
+uint64_t RunThreads(int n, int cpus, void* (*f)(void*)) {
+  pthread_t threads[64];
+  const uint64_t start = SyscallClockGetTime().value;
+  for (int i = 0; i < n; ++i) {
+    if (pthread_create(&threads[i], nullptr, f, nullptr) != 0) {
+      printf("failed to create a thread\n");
+      exit(1);
+    }
+  }
+  for (int i = 0; i < n; ++i) {
+    pthread_join(threads[i], nullptr);
+  }
+  const uint64_t elapsed = SyscallClockGetTime().value - start;
+  return elapsed * cpus / (n * yields);
+}
+
+extern "C" void main(int argc, char** argv) {
+  if (argc <= 1) {
+    printf("Usage: switchbench <the number of CPUs> [yields per thread]\n");
+    exit(1);
+  }
+  const int cpus = atoi(argv[1]);
+  if (cpus < 1 || 32 < cpus) {
+    printf("the number of CPUs must be 1 .. 32\n");
+    exit(1);
+  }
+  if (argc >= 3) {
+    yields = strtoul(argv[2], nullptr, 0);
+  }
+
+  const int n = 2 * cpus;
+  printf("integer only: %lu ns per switch\n", RunThreads(n, cpus, YieldInt));
+  printf("with SSE    : %lu ns per switch\n", RunThreads(n, cpus, YieldFPU));
+  exit(0);
+}
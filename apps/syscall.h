@@ -10,6 +10,7 @@ extern "C" {
 
 #include "../kernel/logger.hpp"
 #include "../kernel/app_event.hpp"
+#include "../kernel/task_stat.hpp"
 
 struct SyscallResult {
   uint64_t value;
@@ -33,12 +34,37 @@ struct SyscallResult SyscallReadEvent(struct AppEvent* events, size_t len);
 
 #define TIMER_ONESHOT_REL 1
 #define TIMER_ONESHOT_ABS 0
+#define TIMER_USEC 2 // timeout is in usec instead of msec
+#define TIMER_HANDLE 4 // return the handle of the timer instead of the timeout
 struct SyscallResult SyscallCreateTimer(unsigned int type, int timer_value, unsigned long timeout_ms);
+struct SyscallResult SyscallCancelTimer(uint64_t handle);
 
 struct SyscallResult SyscallOpenFile(const char* path, int flags);
 struct SyscallResult SyscallReadFile(int fd, void* buf, size_t count);
 struct SyscallResult SyscallDemandPages(size_t num_pages, int flags);
 struct SyscallResult SyscallMapFile(int fd, size_t* file_size, int flags);
+// nanoseconds since the boot
+struct SyscallResult SyscallClockGetTime();
+// set the nice value (-20 .. 19) of the calling task, return the previous one
+struct SyscallResult SyscallSetNice(int nice);
+struct SyscallResult SyscallYield();
+// copy CPU usage of up to len tasks to stats, return the number of copied entries
+struct SyscallResult SyscallTaskStat(struct TaskStat* stats, size_t len);
+// start a thread sharing the address space and files at entry(0, arg) with the stack below stack_end
+// the thread ends with SyscallExit, which returns its exit code to SyscallThreadJoin
+struct SyscallResult SyscallThreadCreate(void (*entry)(int, void*), void* arg, void* stack_end);
+struct SyscallResult SyscallThreadJoin(uint64_t thread_id);
+// sleep while *addr == expected (EAGAIN if not), wake up count sleepers of addr
+// FutexWait may return without FutexWake, so check *addr again
+struct SyscallResult SyscallFutexWait(volatile uint32_t* addr, uint32_t expected);
+struct SyscallResult SyscallFutexWake(volatile uint32_t* addr, int count);
+
+#define MADV_NORMAL 0
+#define MADV_RANDOM 1 // map only the faulting page
+#define MADV_SEQUENTIAL 2 // map many pages ahead from the first fault
+#define MADV_WILLNEED 3 // map the pages now
+// hint the access pattern of [addr, addr + len) in a region of SyscallDemandPages or SyscallMapFile
+struct SyscallResult SyscallMAdvise(void* addr, size_t len, int advice);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,45 @@
+#include <cstdio>
+#include <cstdlib>
+#include "../syscall.h"
+
+// create many timers at once, spread over every level of the timer wheel, then cancel them
+const int kMaxTimers = 100000;
+uint64_t handles[kMaxTimers];
+
+extern "C" void main(int argc, char** argv) {
+  int n = 10000;
+  if (argc >= 2) {
+    n = atoi(argv[1]);
+  }
+  if (n < 1 || kMaxTimers < n) {
+    printf("the number of timers must be 1 .. %d\n", kMaxTimers);
+    exit(1);
+  }
+
+  // timeouts from 1 sec to about 1 hour, so none of them expires during the run
+  const unsigned long kSpreadMs = 3600 * 1000;
+  uint64_t start = SyscallClockGetTime().value;
+  for (int i = 0; i < n; ++i) {
+    const unsigned long timeout_ms = 1000 + kSpreadMs / n * i;
+    auto res = SyscallCreateTimer(TIMER_ONESHOT_REL | TIMER_HANDLE, 1, timeout_ms);
+    if (res.error) {
+      printf("failed to create timer %d: %d\n", i, res.error);
+      exit(1);
+    }
+    handles[i] = res.value;
+  }
+  const uint64_t create_ns = SyscallClockGetTime().value - start;
+
+  start = SyscallClockGetTime().value;
+  int canceled = 0;
+  for (int i = 0; i < n; ++i) {
+    if (!SyscallCancelTimer(handles[i]).error) {
+      ++canceled;
+    }
+  }
+  const uint64_t cancel_ns = SyscallClockGetTime().value - start;
+
+  printf("create %d timers: %lu us (%lu ns each)\n", n, create_ns / 1000, create_ns / n);
+  printf("cancel %d timers: %lu us (%lu ns each)\n", canceled, cancel_ns / 1000, cancel_ns / n);
+  exit(canceled == n ? 0 : 1);
+}
@@ -0,0 +1,83 @@
+#include <cstdio>
+#include <cstdlib>
+#include "../pthread.h"
+#include "../syscall.h"
+
+// two threads of a pair hand a turn to each other with futexes, so each
+// hand-off wakes up the sleeping partner; more pairs keep more CPUs busy
+// with wakeups at the same time
+const int kMaxPairs = 16;
+unsigned long rounds = 20000;
+
+struct Pair {
+  volatile uint32_t turn; // 0 or 1: the side which may go
+  uint64_t wakeups[2];
+};
+Pair pairs[kMaxPairs];
+
+struct Side {
+  Pair* pair;
+  uint32_t me;
+};
+Side sides[kMaxPairs][2];
+
+void* PingPong(void* arg) {
+  auto side = reinterpret_cast<Side*>(arg);
+  Pair& p = *side->pair;
+  for (unsigned long i = 0; i < rounds; ++i) {
+    while (p.turn != side->me) {
+      SyscallFutexWait(&p.turn, 1 - side->me);
+    }
+    p.turn = 1 - side->me;
+    p.wakeups[side->me] += SyscallFutexWake(&p.turn, 1).value;
+  }
+  return nullptr;
+}
+
+// wakeups per second with n pairs running at once
+uint64_t Run(int n) {
+  pthread_t threads[kMaxPairs][2];
+  for (int i = 0; i < n; ++i) {
+    pairs[i] = Pair{0, {0, 0}};
+  }
+  const uint64_t start = SyscallClockGetTime().value;
+  for (int i = 0; i < n; ++i) {
+    for (uint32_t me = 0; me < 2; ++me) {
+      sides[i][me] = Side{&pairs[i], me};
+      if (pthread_create(&threads[i][me], nullptr, PingPong, &sides[i][me]) != 0) {
+        printf("failed to create a thread\n");
+        exit(1);
+      }
+    }
+  }
+  for (int i = 0; i < n; ++i) {
+    pthread_join(threads[i][0], nullptr);
+    pthread_join(threads[i][1], nullptr);
+  }
+  const uint64_t elapsed = SyscallClockGetTime().value - start;
+
+  uint64_t wakeups = 0;
+  for (int i = 0; i < n; ++i) {
+    wakeups += pairs[i].wakeups[0] + pairs[i].wakeups[1];
+  }
+  return elapsed > 0 ? wakeups * 1000000000 / elapsed : 0;
+}
+
+extern "C" void main(int argc, char** argv) {
+  int max_pairs = 4;
+  if (argc >= 2) {
+    max_pairs = atoi(argv[1]);
+  }
+  if (argc >= 3) {
+    rounds = strtoul(argv[2], nullptr, 0);
+  }
+  if (max_pairs < 1 || kMaxPairs < max_pairs) {
+    printf("pairs must be 1 .. %d\n", kMaxPairs);
+    exit(1);
+  }
+
+  for (int n = 1; n <= max_pairs; n *= 2) {
+    printf("%2d pairs: %lu wakeups/s\n", n, Run(n));
+  }
+  exit(0);
+}
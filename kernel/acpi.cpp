@@ -64,6 +64,7 @@ namespace acpi{
   }
 
   const FADT* fadt;
+  const MADT* madt;
 
   void WaitMilliseconds(unsigned long msec) {
     const bool pm_timer_32 = (fadt->flags >> 8) & 1;
@@ -95,11 +96,13 @@ namespace acpi{
     }
 
     fadt = nullptr;
+    madt = nullptr;
     for (int i = 0; i < xsdt.Count(); ++i) {
       const auto& entry = xsdt[i];
       if (entry.IsValid("FACP")) {
         fadt = reinterpret_cast<const FADT*>(&entry);
-        break;
+      } else if (entry.IsValid("APIC")) {
+        madt = reinterpret_cast<const MADT*>(&entry);
       }
     }
 
@@ -107,5 +110,28 @@ namespace acpi{
       Log(kError, "FADT is not found\n");
       exit(1);
     }
+    if (madt == nullptr) {
+      Log(kWarn, "MADT is not found: APs are not available\n");
+    }
+  }
+
+  std::vector<uint8_t> ProcessorLocalAPICIDs() {
+    std::vector<uint8_t> ids;
+    if (madt == nullptr) {
+      return ids;
+    }
+
+    auto p = reinterpret_cast<const uint8_t*>(madt + 1);
+    const auto end = reinterpret_cast<const uint8_t*>(madt) + madt->header.length;
+    while (p + 2 <= end && p[1] > 0) {
+      if (p[0] == 0) { // Processor Local APIC
+        const auto& lapic = *reinterpret_cast<const ProcessorLocalAPIC*>(p);
+        if (lapic.flags & 1) { // enabled
+          ids.push_back(lapic.apic_id);
+        }
+      }
+      p += p[1];
+    }
+    return ids;
   }
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <cstdio>
+#include <cstdint>
+#include <vector>
 
 namespace acpi {
   struct RSDP {
@@ -48,9 +50,29 @@ namespace acpi {
     char reserved3[276 - 116];
   }  __attribute__((packed));
 
+  struct MADT {
+    DescriptionHeader header;
+
+    uint32_t lapic_address;
+    uint32_t flags;
+    // followed by variable length interrupt controller structures
+  } __attribute__((packed));
+
+  struct ProcessorLocalAPIC {
+    uint8_t type; // 0
+    uint8_t length;
+    uint8_t acpi_processor_uid;
+    uint8_t apic_id;
+    uint32_t flags; // bit 0: enabled, bit 1: online capable
+  } __attribute__((packed));
+
   extern const FADT* fadt;
+  extern const MADT* madt;
   const int kPMTimerFreq = 3579545;
 
+  // local APIC IDs of the usable processors listed in MADT
+  std::vector<uint8_t> ProcessorLocalAPICIDs();
+
   void WaitMilliseconds(unsigned long msec);
   void Initialize(const RSDP& rsdp);
 }
@@ -6,6 +6,8 @@
 bits 64
 section .text
 
+extern kernel_lock  ; std::atomic<uint32_t>, 0 when nobody holds the lock
+
 global IoOut32   ; void IoOut32(uint16_t addr, uint32_t data);
 IoOut32:
   mov dx, di     ; dx = addr
@@ -71,6 +73,23 @@ GetCR2:
     mov rax, cr2
     ret
 
+global GetCR4  ; uint64_t GetCR4();
+GetCR4:
+    mov rax, cr4
+    ret
+
+global SetCR4  ; void SetCR4(uint64_t value);
+SetCR4:
+    mov cr4, rdi
+    ret
+
+global ReadTSC  ; uint64_t ReadTSC();
+ReadTSC:
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    ret
+
 global SetCSSS        ; void SetCSSS(uint16_t cs, uint16_t ss);
 SetCSSS:
   push rbp
@@ -145,7 +164,14 @@ SwitchContext:         ; void SwitchContext(void* next_ctx, void* current_ctx);
   mov dx, gs
   mov [rsi + 0x38], rdx
 
-  fxsave [rsi + 0xc0]
+  mov rax, cr0
+  test rax, 8  ; CR0.TS is clear if the task has used the FPU since it was switched in
+  jnz .fpu_unused
+  push rdi
+  lea rdi, [rsi + 0xc0]
+  call SaveFPUState
+  pop rdi
+.fpu_unused:
   ; fall through to RestoreContext
 
 global RestoreContext
@@ -158,7 +184,10 @@ RestoreContext:  ; void RestoreContext(void* task_context);
   push qword [rdi + 0x20] ; CS
   push qword [rdi + 0x08] ; RIP
 
-  fxrstor [rdi + 0xc0]
+  ; the FPU state is loaded by #NM when the next task uses the FPU
+  mov rax, cr0
+  or rax, 8  ; CR0.TS
+  mov cr0, rax
 
   mov rax, [rdi + 0x00]
   mov cr3, rax
@@ -182,6 +211,10 @@ RestoreContext:  ; void RestoreContext(void* task_context);
   mov r14, [rdi + 0xb0]
   mov r15, [rdi + 0xb8]  
 
+  test qword [rsp + 0x08], 3  ; CS in the iret frame
+  jz .iret
+  mov dword [kernel_lock], 0  ; release the kernel lock when going back to the app
+.iret:
   mov rdi, [rdi + 0x60]
 
   o64 iret
@@ -196,15 +229,19 @@ CallApp:  ; void CallApp(int argc, char** argv, uint16_t ss, uint64_t rip, uint6
     push r15
     mov [r9], rsp ; Save os stack pointer
 
+    cli
     push rdx  ; SS
     push r8   ; RSP
+    pushfq
+    or qword [rsp], 0x200  ; RFLAGS (IF = 1)
     add rdx, 8
     push rdx  ; CS
     push rcx   ; RIP
-    o64 retf
+    mov dword [kernel_lock], 0  ; release the kernel lock while the app runs
+    o64 iret
 
 extern LAPICTimerOnInterrupt
-; void LAPICTimerOnInterrupt(const TaskContext& ctx_stack);
+; void LAPICTimerOnInterrupt(const TaskContext& ctx_stack, bool fpu_used);
 
 global IntHandlerLAPICTimer
 IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
@@ -212,8 +249,8 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
     mov rbp, rsp
 
     ; Create TaskContext struct on the stack
-    sub rsp, 512
-    fxsave [rsp]
+    sub rsp, 1024  ; FPU area (kFPUAreaBytes)
+    and rsp, -64   ; alignment for xsave
     push r15
     push r14
     push r13
@@ -244,9 +281,36 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
     push qword [rbp + 0x08]  ; RIP
     push rcx                 ; CR3
 
+    ; save the FPU state only if the interrupted task has used the FPU
+    xor ebx, ebx
+    mov rax, cr0
+    test rax, 8  ; CR0.TS
+    jnz .fpu_unused
+    lea rdi, [rsp + 0xc0]
+    call SaveFPUStateFull
+    mov ebx, 1
+    jmp .fpu_saved
+.fpu_unused:
+    clts  ; the handler may use SSE registers
+.fpu_saved:
+
+    mov r12, rsp
     mov rdi, rsp
+    mov esi, ebx  ; fpu_used
     call LAPICTimerOnInterrupt
 
+    ; back to the interrupted task (rbx and r12 are kept by the callee)
+    test ebx, ebx
+    jz .fpu_reset
+    lea rdi, [r12 + 0xc0]
+    call RestoreFPUState
+    jmp .fpu_restored
+.fpu_reset:
+    mov rax, cr0
+    or rax, 8  ; CR0.TS
+    mov cr0, rax
+.fpu_restored:
+
     add rsp, 8*8  ; ignore CR3 to GS
     pop rax
     pop rbx
@@ -263,12 +327,103 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
     pop r13
     pop r14
     pop r15
-    fxrstor [rsp]
 
     mov rsp, rbp
     pop rbp
     iretq
 
+extern fpu_save_mode  ; 0: fxsave, 1: xsave, 2: xsaveopt
+global SaveFPUState
+SaveFPUState:  ; void SaveFPUState(void* area);
+    mov eax, [fpu_save_mode]
+    test eax, eax
+    jnz .xsave
+    fxsave [rdi]
+    ret
+.xsave:
+    ; XCOMP_BV and the reserved bytes of the XSAVE header must be 0 for xrstor
+    xor edx, edx
+    mov [rdi + 512 + 8], rdx
+    mov [rdi + 512 + 16], rdx
+    cmp eax, 2
+    mov eax, -1
+    mov edx, -1  ; every component enabled in XCR0
+    je .xsaveopt
+    xsave [rdi]
+    ret
+.xsaveopt:
+    xsaveopt [rdi]
+    ret
+
+global SaveFPUStateFull
+SaveFPUStateFull:  ; void SaveFPUStateFull(void* area);
+    ; same as SaveFPUState but never with xsaveopt, for an area which was not the source of
+    ; the last xrstor (the area on the interrupt stack is reused by every interrupt,
+    ; and xsaveopt could leave the state of another task in the components it skips)
+    mov eax, [fpu_save_mode]
+    test eax, eax
+    jnz .xsave
+    fxsave [rdi]
+    ret
+.xsave:
+    xor edx, edx
+    mov [rdi + 512 + 8], rdx
+    mov [rdi + 512 + 16], rdx
+    mov eax, -1
+    mov edx, -1
+    xsave [rdi]
+    ret
+
+global RestoreFPUState
+RestoreFPUState:  ; void RestoreFPUState(void* area);
+    mov eax, [fpu_save_mode]
+    test eax, eax
+    jnz .xrstor
+    fxrstor [rdi]
+    ret
+.xrstor:
+    mov eax, -1
+    mov edx, -1
+    xrstor [rdi]
+    ret
+
+global SetXCR0
+SetXCR0:  ; void SetXCR0(uint64_t value);
+    mov rdx, rdi
+    shr rdx, 32
+    mov eax, edi
+    xor ecx, ecx
+    xsetbv
+    ret
+
+extern GetCurrentTaskFPUArea
+global IntHandlerNM
+IntHandlerNM:  ; void IntHandlerNM();
+    ; the running task uses the FPU for the first time since it was switched in
+    push rax
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push r8
+    push r9
+    push r10
+    push r11
+    clts
+    call GetCurrentTaskFPUArea
+    mov rdi, rax
+    call RestoreFPUState
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rax
+    iretq
+
 global LoadTR
 LoadTR:  ; void LoadTR(uint16_t sel);
     ltr di
@@ -284,6 +439,7 @@ WriteMSR:  ; void WriteMSR(uint32_t msr, uint64_t value);
     ret
 
 extern GetCurrentTaskOSStackPointer
+extern LockKernel
 extern syscall_table
 global SyscallEntry
 SyscallEntry:  ; void SyscallEntry(void);
@@ -302,6 +458,7 @@ SyscallEntry:  ; void SyscallEntry(void);
     push rax
     push rdx
     cli
+    call LockKernel
     call GetCurrentTaskOSStackPointer
     sti
     mov rdx, [rsp + 0]  ; RDX
@@ -324,6 +481,8 @@ SyscallEntry:  ; void SyscallEntry(void);
     cmp esi, 0x80000002
     je  .exit
 
+    cli
+    mov dword [kernel_lock], 0  ; release the kernel lock before going back to the app
     pop r11
     pop rcx
     pop rbp
@@ -351,4 +510,103 @@ ExitApp:
 global InvalidateTLB  ; void invalidateTLB(uint64_t addr);
 InvalidateTLB:
     invlpg [rdi];
-    ret
\ No newline at end of file
+    ret
+
+global InvalidatePCID  ; void InvalidatePCID(uint64_t type, const void* descriptor);
+InvalidatePCID:
+    invpcid rdi, [rsi]
+    ret
+
+global ZeroFrameNonTemporal  ; void ZeroFrameNonTemporal(void* frame);
+ZeroFrameNonTemporal:
+    ; movnti bypasses the cache, so zeroing frames ahead does not evict the data
+    ; of the tasks. it uses a general register, so CR0.TS does not matter
+    xor eax, eax
+    mov ecx, 4096 / 64
+.loop:
+    movnti [rdi + 0x00], rax
+    movnti [rdi + 0x08], rax
+    movnti [rdi + 0x10], rax
+    movnti [rdi + 0x18], rax
+    movnti [rdi + 0x20], rax
+    movnti [rdi + 0x28], rax
+    movnti [rdi + 0x30], rax
+    movnti [rdi + 0x38], rax
+    add rdi, 64
+    dec ecx
+    jnz .loop
+    sfence  ; the stores are weakly ordered, finish them before the frame is used
+    ret
+
+; AP startup trampoline
+; copied to AP_TRAMPOLINE_BASE and executed by each AP from real mode after
+; INIT-SIPI-SIPI. it goes to long mode with the page table of the BSP and
+; jumps to the entry point in ApBootParams on the given stack.
+%define AP_TRAMPOLINE_BASE 0x8000
+%define AP_ADDR(label) (AP_TRAMPOLINE_BASE + (label) - ApTrampoline)
+
+bits 16
+global ApTrampoline
+ApTrampoline:
+    cli
+    mov ax, cs
+    mov ds, ax
+    lgdt [ap_gdtr - ApTrampoline]
+    mov eax, cr0
+    or eax, 1  ; PE
+    mov cr0, eax
+    jmp dword 0x08:AP_ADDR(ap_protected_mode)
+
+bits 32
+ap_protected_mode:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    mov eax, [AP_ADDR(ap_boot_cr4)]  ; PAE and SSE bits of the BSP
+    mov cr4, eax
+    mov eax, [AP_ADDR(ap_boot_cr3)]
+    mov cr3, eax
+    mov ecx, 0xc0000080  ; IA32_EFER
+    rdmsr
+    or eax, 0x100        ; LME
+    wrmsr
+    mov eax, [AP_ADDR(ap_boot_cr0)]  ; PG and PE
+    mov cr0, eax
+    jmp 0x18:AP_ADDR(ap_long_mode)
+
+bits 64
+ap_long_mode:
+    xor ax, ax
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    mov rsp, [AP_ADDR(ap_boot_stack)]
+    mov rax, [AP_ADDR(ap_boot_entry)]
+    call rax
+.fin:
+    hlt
+    jmp .fin
+
+align 16
+ap_gdt:
+    dq 0
+    dq 0x00cf9a000000ffff  ; 0x08: 32 bit code
+    dq 0x00cf92000000ffff  ; 0x10: 32 bit data
+    dq 0x00af9a000000ffff  ; 0x18: 64 bit code
+ap_gdtr:
+    dw ap_gdtr - ap_gdt - 1
+    dd AP_ADDR(ap_gdt)
+
+align 8
+global ApBootParams
+ApBootParams:
+ap_boot_cr3:   dq 0
+ap_boot_cr0:   dq 0
+ap_boot_cr4:   dq 0
+ap_boot_stack: dq 0
+ap_boot_entry: dq 0
+ap_boot_started: dd 0
+
+global ApTrampolineEnd
+ApTrampolineEnd:
@@ -12,6 +12,8 @@ extern "C" {
 	uint64_t GetCR0();
 	void SetCR0(uint64_t value);
 	uint64_t GetCR2();
+	uint64_t GetCR4();
+	void SetCR4(uint64_t value);
 	void SetCSSS(uint16_t cs, uint16_t ss);
 	void SetCR3(uint64_t value);
 	uint64_t GetCR3();
@@ -24,4 +26,12 @@ extern "C" {
 	void SyscallEntry(void);
 	void ExitApp(uint64_t rsp, int32_t ret_val);
 	void InvalidateTLB(uint64_t addr);
+	void InvalidatePCID(uint64_t type, const void* descriptor);
+	void ZeroFrameNonTemporal(void* frame);
+	void SaveFPUState(void* area);
+	void RestoreFPUState(void* area);
+	void SetXCR0(uint64_t value);
+	void IntHandlerNM();
+	uint64_t ReadTSC();
+	extern uint8_t ApTrampoline[], ApBootParams[], ApTrampolineEnd[];
 }
\ No newline at end of file
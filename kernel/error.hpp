@@ -33,6 +33,9 @@ class Error {
       kIsDirectory,
       kNoSuchEntry,
       kFreeTypeError,
+      kNoResponse,
+      kValueMismatch,
+      kInterrupted,
       kLastOfCode,
     };
 
@@ -92,6 +95,9 @@ class Error {
       "kIsDirectory",
       "kNoSuchEntry",
       "kFreeTypeError",
+      "kNoResponse",
+      "kValueMismatch",
+      "kInterrupted",
     };
     
     Code code_;
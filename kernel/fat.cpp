@@ -5,6 +5,8 @@
 #include <cctype>
 #include <utility>
 
+#include "slab.hpp"
+
 namespace {
 
 std::pair<const char*, bool>
@@ -250,6 +252,14 @@ FileDescriptor::FileDescriptor(DirectoryEntry& fat_entry)
     : fat_entry_{fat_entry} {
 }
 
+void* FileDescriptor::operator new(size_t bytes) {
+  return SlabNew<FileDescriptor>("fat::FileDescriptor");
+}
+
+void FileDescriptor::operator delete(void* p) {
+  SlabDelete<FileDescriptor>("fat::FileDescriptor", p);
+}
+
 size_t FileDescriptor::Read(void* buf, size_t len) {
   if (rd_cluster_ == 0) {
     rd_cluster_ = fat_entry_.FirstCluster();
@@ -319,17 +329,26 @@ size_t FileDescriptor::Write(const void* buf, size_t len) {
 }
 
 size_t FileDescriptor::Load(void* buf, size_t len, size_t offset) {
+  if (offset >= fat_entry_.file_size) {
+    return 0;
+  }
   FileDescriptor fd{fat_entry_};
   fd.rd_off_ = offset;
 
-  unsigned long cluster = fat_entry_.FirstCluster();
-  while (offset >= bytes_per_cluster) {
-    offset -= bytes_per_cluster;
-    cluster = NextCluster(cluster);
+  // walk the cluster chain from the cluster of the last Load unless offset is before it,
+  // so that loading a file from the head to the tail walks the chain only once
+  const size_t cluster_index = offset / bytes_per_cluster;
+  if (ld_cluster_ == 0 || cluster_index < ld_cluster_index_) {
+    ld_cluster_index_ = 0;
+    ld_cluster_ = fat_entry_.FirstCluster();
+  }
+  while (ld_cluster_index_ < cluster_index) {
+    ld_cluster_ = NextCluster(ld_cluster_);
+    ++ld_cluster_index_;
   }
 
-  fd.rd_cluster_ = cluster;
-  fd.rd_cluster_off_ = offset;
+  fd.rd_cluster_ = ld_cluster_;
+  fd.rd_cluster_off_ = offset % bytes_per_cluster;
   return fd.Read(buf, len);
 }
 
@@ -112,6 +112,9 @@ unsigned long AllocateClusterChain(size_t n);
 class FileDescriptor : public ::FileDescriptor{
  public:
   explicit FileDescriptor(DirectoryEntry& fat_entry);
+  // file descriptors are kept in a slab cache
+  static void* operator new(size_t bytes);
+  static void operator delete(void* p);
   size_t Read(void* buf, size_t len) override;
   size_t Write(const void* buf, size_t len) override;
   size_t Size() const override { return fat_entry_.file_size; }
@@ -125,6 +128,9 @@ class FileDescriptor : public ::FileDescriptor{
   size_t wr_off_ = 0;
   unsigned long wr_cluster_ = 0;
   size_t wr_cluster_off_ = 0;
+  // cluster of the last Load and its index in the cluster chain
+  size_t ld_cluster_index_ = 0;
+  unsigned long ld_cluster_ = 0;
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,56 @@
+#include "fpu.hpp"
+
+#include <cpuid.h>
+
+#include "asmfunc.h"
+#include "logger.hpp"
+
+namespace {
+  const uint64_t kCR4OSXSAVE = 1ul << 18;
+  // state components in XCR0
+  const uint64_t kXCR0X87 = 1ul << 0;
+  const uint64_t kXCR0SSE = 1ul << 1;
+  const uint64_t kXCR0AVX = 1ul << 2;
+
+  uint64_t xcr0 = 0;
+
+  void EnableXSave() {
+    SetCR4(GetCR4() | kCR4OSXSAVE);
+    SetXCR0(xcr0);
+  }
+}
+
+extern "C" FPUSaveMode fpu_save_mode = kFXSave;
+
+void InitializeFPU() {
+  unsigned int eax, ebx, ecx, edx;
+  __cpuid(1, eax, ebx, ecx, edx);
+  if ((ecx & (1u << 26)) == 0) { // XSAVE
+    Log(kInfo, "FPU state is saved with fxsave\n");
+    return;
+  }
+
+  xcr0 = kXCR0X87 | kXCR0SSE;
+  if (ecx & (1u << 28)) { // AVX
+    xcr0 |= kXCR0AVX;
+  }
+  EnableXSave();
+
+  // size of the XSAVE area for the components enabled in XCR0
+  __cpuid_count(0xd, 0, eax, ebx, ecx, edx);
+  if (ebx > kFPUAreaBytes) {
+    xcr0 = kXCR0X87 | kXCR0SSE;
+    SetXCR0(xcr0);
+  }
+
+  __cpuid_count(0xd, 1, eax, ebx, ecx, edx);
+  fpu_save_mode = (eax & 1u) ? kXSaveOpt : kXSave;
+  Log(kInfo, "FPU state is saved with %s (XCR0 = %lx)\n",
+      fpu_save_mode == kXSaveOpt ? "xsaveopt" : "xsave", xcr0);
+}
+
+void InitializeFPUForAP() {
+  if (fpu_save_mode != kFXSave) {
+    EnableXSave();
+  }
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// FPU/SSE/AVX state of tasks is loaded lazily:
+// a context switch sets CR0.TS and the first FPU instruction of the task raises #NM,
+// then the #NM handler loads the state of the task
+
+// size of the save area in TaskContext (enough for x87, SSE and AVX)
+const size_t kFPUAreaBytes = 1024;
+
+// instruction used to save the FPU state (read from asmfunc.asm)
+enum FPUSaveMode : int32_t {
+  kFXSave,
+  kXSave,
+  kXSaveOpt,
+};
+extern "C" FPUSaveMode fpu_save_mode;
+
+// select the save instruction and enable XSAVE features on the BSP
+void InitializeFPU();
+// enable the XSAVE features chosen by the BSP on an AP
+void InitializeFPUForAP();
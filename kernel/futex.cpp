@@ -0,0 +1,97 @@
+#include "futex.hpp"
+
+#include <array>
+#include <list>
+
+#include "task.hpp"
+#include "wait_queue.hpp"
+
+namespace {
+  struct FutexKey {
+    const ThreadGroup* group;
+    uintptr_t addr;
+
+    bool operator==(const FutexKey& rhs) const {
+      return group == rhs.group && addr == rhs.addr;
+    }
+  };
+
+  // a wait queue of a futex word exists while some tasks use it
+  struct FutexQueue {
+    FutexKey key;
+    int users;
+    WaitQueue queue;
+  };
+
+  const size_t kNumFutexBuckets = 64;
+  std::array<std::list<FutexQueue>, kNumFutexBuckets>* futex_buckets;
+
+  FutexKey CurrentKey(volatile uint32_t* addr) {
+    return {&task_manager->CurrentTask().Group(), reinterpret_cast<uintptr_t>(addr)};
+  }
+
+  std::list<FutexQueue>& BucketOf(const FutexKey& key) {
+    const auto group = reinterpret_cast<uintptr_t>(key.group);
+    return (*futex_buckets)[((key.addr >> 2) ^ (group >> 4)) % kNumFutexBuckets];
+  }
+
+  std::list<FutexQueue>::iterator FindQueue(std::list<FutexQueue>& bucket,
+                                            const FutexKey& key) {
+    auto it = bucket.begin();
+    while (it != bucket.end() && !(it->key == key)) {
+      ++it;
+    }
+    return it;
+  }
+}
+
+void InitializeFutex() {
+  futex_buckets = new std::array<std::list<FutexQueue>, kNumFutexBuckets>;
+}
+
+Error FutexWait(volatile uint32_t* addr, uint32_t expected) {
+  Task& task = task_manager->CurrentTask();
+  if (task.Killed()) {
+    return MAKE_ERROR(Error::kInterrupted);
+  }
+  // FutexWake needs the kernel lock, so it cannot run between this check and Wait
+  if (*addr != expected) {
+    return MAKE_ERROR(Error::kValueMismatch);
+  }
+
+  const auto key = CurrentKey(addr);
+  auto& bucket = BucketOf(key);
+  auto it = FindQueue(bucket, key);
+  if (it == bucket.end()) {
+    it = bucket.insert(bucket.end(), FutexQueue{key, 0, {}});
+  }
+
+  ++it->users;
+  bool woken = false;
+  while (!woken && !task.Killed()) {
+    woken = it->queue.Wait();
+  }
+  if (--it->users == 0) {
+    bucket.erase(it);
+  }
+
+  if (!woken) {
+    return MAKE_ERROR(Error::kInterrupted);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+int FutexWake(volatile uint32_t* addr, int n) {
+  const auto key = CurrentKey(addr);
+  auto& bucket = BucketOf(key);
+  auto it = FindQueue(bucket, key);
+  if (it == bucket.end()) {
+    return 0;
+  }
+
+  int woken = 0;
+  for (; woken < n && !it->queue.Empty(); ++woken) {
+    it->queue.WakeupOne();
+  }
+  return woken;
+}
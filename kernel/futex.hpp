@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+
+#include "error.hpp"
+
+// futex: threads of an app sleep on a 32-bit word in the app memory
+// the word is identified by the thread group (address space) and its virtual address
+// call these functions with interrupts disabled
+
+void InitializeFutex();
+
+// sleep the running task while *addr == expected
+// kValueMismatch: *addr != expected, kInterrupted: the app is exiting
+// the task may return kSuccess without FutexWake, so check the word again
+Error FutexWait(volatile uint32_t* addr, uint32_t expected);
+// wake up at most n tasks sleeping on addr, return the number of woken tasks
+int FutexWake(volatile uint32_t* addr, int n);
@@ -85,6 +85,14 @@ Rectangle<T> operator&(const Rectangle<T>& lhs, const Rectangle<U>& rhs) {
   return {new_pos, new_size};
 }
 
+// smallest rectangle that contains both rectangles
+template <typename T, typename U>
+Rectangle<T> operator|(const Rectangle<T>& lhs, const Rectangle<U>& rhs) {
+  const auto new_pos = ElementMin(lhs.pos, rhs.pos);
+  const auto new_end = ElementMax(lhs.pos + lhs.size, rhs.pos + rhs.size);
+  return {new_pos, new_end - new_pos};
+}
+
 class PixelWriter {
   public:
     virtual ~PixelWriter() = default;
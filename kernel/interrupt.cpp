@@ -9,6 +9,7 @@
 #include "graphics.hpp"
 #include "font.hpp"
 #include "paging.hpp"
+#include "smp.hpp"
 
 std::array<InterruptDescriptor, 256> idt;
 
@@ -38,8 +39,19 @@ namespace {
   // interrupt handler function for USB(XHC)
   __attribute__((interrupt))
   void IntHandlerXHCI(InterruptFrame* frame) {
+    const bool locked = LockKernel();
     task_manager->SendMessage(1, Message{Message::kInterruptXHCI}); // 1 is main task
     NotifyEndOfInterrupt();
+    if (locked) {
+      UnlockKernel();
+    }
+  }
+
+  // does not take the kernel lock: the sender holds it and waits for this handler
+  __attribute__((interrupt))
+  void IntHandlerTLBShootdown(InterruptFrame* frame) {
+    HandleTLBShootdown();
+    NotifyEndOfInterrupt();
   }
 
   void PrintHex(uint64_t value, int width, Vector2D<int> pos) {
@@ -80,7 +92,11 @@ namespace {
   __attribute__((interrupt))
   void IntHandlerPF(InterruptFrame* frame, uint64_t error_code) {
     uint64_t cr2 = GetCR2();
+    const bool locked = LockKernel();
     if (auto err = HandlePageFault(error_code, cr2); !err) {
+      if (locked) {
+        UnlockKernel();
+      }
       return;
     }
     KillApp(frame);
@@ -93,6 +109,7 @@ namespace {
 #define FaultHandlerWithError(fault_name) \
   __attribute__((interrupt)) \
   void IntHandler ## fault_name (InterruptFrame* frame, uint64_t error_code) { \
+    LockKernel(); \
     KillApp(frame); \
     PrintFrame(frame, "#" #fault_name); \
     WriteString(*screen_writer, {500, 16*4}, "ERR", {0, 0, 0}); \
@@ -103,6 +120,7 @@ namespace {
 #define FaultHandlerNoError(fault_name) \
   __attribute__((interrupt)) \
   void IntHandler ## fault_name (InterruptFrame* frame) { \
+    LockKernel(); \
     KillApp(frame); \
     PrintFrame(frame, "#" #fault_name); \
     while (true) __asm__("hlt"); \
@@ -114,7 +132,6 @@ namespace {
   FaultHandlerNoError(OF)
   FaultHandlerNoError(BR)
   FaultHandlerNoError(UD)
-  FaultHandlerNoError(NM)
   FaultHandlerWithError(DF)
   FaultHandlerWithError(TS)
   FaultHandlerWithError(NP)
@@ -138,11 +155,18 @@ void InitializeInterrupt() {
                 kKernelCS);
   };
   set_idt_entry(InterruptVector::kXHCI, IntHandlerXHCI);
+  set_idt_entry(InterruptVector::kTLBShootdown, IntHandlerTLBShootdown);
   SetIDTEntry(idt[InterruptVector::kLAPICTimer],
               MakeIDTAttr(DescriptorType::kInterruptGate, 0 /* DPL */,
                           true /* present */, kISTForTimer /* IST */),
               reinterpret_cast<uint64_t>(IntHandlerLAPICTimer),
               kKernelCS);
+  // same as the timer: the handler reprograms the timer and switches the task if needed
+  SetIDTEntry(idt[InterruptVector::kReschedule],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0 /* DPL */,
+                          true /* present */, kISTForTimer /* IST */),
+              reinterpret_cast<uint64_t>(IntHandlerLAPICTimer),
+              kKernelCS);
   set_idt_entry(0, IntHandlerDE);
   set_idt_entry(1, IntHandlerDB);
   set_idt_entry(3, IntHandlerBP);
@@ -150,7 +174,11 @@ void InitializeInterrupt() {
   set_idt_entry(5, IntHandlerBR);
   set_idt_entry(6, IntHandlerUD);
   set_idt_entry(7, IntHandlerNM);
-  set_idt_entry(8, IntHandlerDF);
+  SetIDTEntry(idt[8],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0 /* DPL */,
+                          true /* present */, kISTForDoubleFault /* IST */),
+              reinterpret_cast<uint64_t>(IntHandlerDF),
+              kKernelCS);
   set_idt_entry(10, IntHandlerTS);
   set_idt_entry(11, IntHandlerNP);
   set_idt_entry(12, IntHandlerSS);
@@ -47,6 +47,8 @@ constexpr InterruptDescriptorAttribute MakeIDTAttr(
 }
 
 const int kISTForTimer = 1; // index of the interrupt stack table
+// #DF gets its own stack, since a kernel stack overflow faults again on the overflowed stack
+const int kISTForDoubleFault = 2;
 
 // set the value of attribute, offset, segment selector to the interrupt descriptor entry
 void SetIDTEntry(InterruptDescriptor& desc,
@@ -57,6 +59,8 @@ void SetIDTEntry(InterruptDescriptor& desc,
 enum InterruptVector {
   kXHCI = 0x40,
   kLAPICTimer = 0x41,
+  kReschedule = 0x42, // IPI to make a CPU check its run queue and timers
+  kTLBShootdown = 0x43, // IPI to make a CPU invalidate a page (see ShootdownTLB)
 };
 
 // interrupt handler receives the following data when it's called
@@ -2,6 +2,7 @@
 
 #include "console.hpp"
 #include "logger.hpp"
+#include "slab.hpp"
 #include "task.hpp"
 #include "timer.hpp"
 
@@ -15,6 +16,14 @@ namespace {
 
 Layer::Layer(unsigned int id) : id_{id} {}
 
+void* Layer::operator new(size_t bytes) {
+  return SlabNew<Layer>("Layer");
+}
+
+void Layer::operator delete(void* p) {
+  SlabDelete<Layer>("Layer", p);
+}
+
 unsigned int Layer::ID() const {
   return id_;
 }
@@ -11,6 +11,9 @@ class Layer {
   public:
     // constructor
     Layer(unsigned int id = 0);
+    // layers are kept in a slab cache
+    static void* operator new(size_t bytes);
+    static void operator delete(void* p);
     // get id of this instance
     unsigned int ID() const;
 
@@ -21,6 +21,10 @@
 #include "terminal.hpp"
 #include "fat.hpp"
 #include "syscall.hpp"
+#include "smp.hpp"
+#include "fpu.hpp"
+#include "stack.hpp"
+#include "futex.hpp"
 
 void operator delete(void* obj) noexcept {
 }
@@ -113,6 +117,8 @@ extern "C" void KernelMainNewStack(
     void* volume_image) {
   // copy the data from UEFI to the local variables (not to be overwritten)
   MemoryMap memory_map{memory_map_ref};
+  // the BSP runs the kernel alone until the main task goes to sleep
+  LockKernel();
 
   InitializeGraphics(frame_buffer_config_ref);
   InitializeConsole();
@@ -125,10 +131,11 @@ extern "C" void KernelMainNewStack(
   }
 
   InitializeSegmentation();
-  InitializePaging();
+  InitializePaging(memory_map);
   InitializeMemoryManager(memory_map);
   InitializeTSS();
   InitializeInterrupt();
+  InitializeFPU();
 
   fat::Initialize(volume_image);
   InitializeFont();
@@ -150,8 +157,10 @@ extern "C" void KernelMainNewStack(
   bool textbox_cursor_visible = false;
 
   InitializeSyscall();
+  InitializeFutex();
 
   app_loads = new std::map<fat::DirectoryEntry*, AppLoadInfo>;
+  InitializeStackAllocator();
   InitializeTask();
   Task& main_task = task_manager->CurrentTask();
   task_manager->NewTask()
@@ -161,6 +170,7 @@ extern "C" void KernelMainNewStack(
   usb::xhci::Initialize();
   InitializeKeyboard();
   InitializeMouse();
+  InitializeSMP();
 
   // counter to show on the main window
   char str[128];
@@ -1,154 +1,389 @@
 #include "memory_manager.hpp"
 
 #include <sys/types.h>
-#include <bitset>
+#include <algorithm>
+#include <cstring>
 
+#include "asmfunc.h"
 #include "error.hpp"
 #include "logger.hpp"
+#include "paging.hpp"
 
-BitmapMemoryManager::BitmapMemoryManager()
- : alloc_map_{}, range_begin_{FrameID{0}}, range_end_{FrameID{kFrameCount}} {}
-
-WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames) {
-  size_t start_frame_id = range_begin_.ID();
-  // first fit algorithm to search for the available memory
-  // worst: O(n)?
-  while(true) {
-    size_t i = 0;
-    for(; i < num_frames; ++i) {
-      // reach the end and no memory with enough length found
-      if (start_frame_id + i >= range_end_.ID()) {
-        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
-      }
-      if (GetBit(FrameID{start_frame_id + i})) {
-        // break and start again if the current FrameID is already taken
-        break;
-      }
+BuddyMemoryManager::BuddyMemoryManager()
+ : frame_table_{nullptr}, free_lists_{}, free_blocks_{}, magazines_{},
+   zeroed_frames_{}, zeroed_count_{0}, range_begin_{FrameID{0}}, range_end_{FrameID{0}} {
+  free_lists_.fill(kNoFrame);
+}
+
+WithError<FrameID> BuddyMemoryManager::Allocate(size_t num_frames) {
+  if (num_frames != 1) {
+    auto block = AllocateBlock(num_frames);
+    if (block.error && zeroed_count_ > 0) {
+      DrainZeroedPool();
+      return AllocateBlock(num_frames);
     }
-    if (i == num_frames) {
-      // found the memory with enough length (num_frames)
-      MarkAllocated(FrameID{start_frame_id}, num_frames);
-      return {
-        FrameID{start_frame_id},
-        MAKE_ERROR(Error::kSuccess),
-      };
+    return block;
+  }
+
+  auto& magazine = magazines_[CurrentCPU()];
+  if (magazine.count == 0) {
+    RefillMagazine(magazine);
+    if (magazine.count == 0) {
+      if (zeroed_count_ > 0) {
+        return {FrameID{zeroed_frames_[--zeroed_count_]}, MAKE_ERROR(Error::kSuccess)};
+      }
+      return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
     }
-    // start again from the next frame
-    start_frame_id += i + 1;
   }
+  return {FrameID{magazine.frames[--magazine.count]}, MAKE_ERROR(Error::kSuccess)};
+}
+
+WithError<FrameID> BuddyMemoryManager::AllocateZeroed() {
+  if (zeroed_count_ > 0) {
+    return {FrameID{zeroed_frames_[--zeroed_count_]}, MAKE_ERROR(Error::kSuccess)};
+  }
+
+  auto frame = Allocate(1);
+  if (!frame.error) {
+    memset(frame.value.Frame(), 0, kBytesPerFrame);
+  }
+  return frame;
+}
+
+void BuddyMemoryManager::PushZeroed(FrameID frame) {
+  if (zeroed_count_ == kZeroedPoolSize) {
+    Free(frame, 1);
+    return;
+  }
+  zeroed_frames_[zeroed_count_++] = frame.ID();
+}
+
+void BuddyMemoryManager::Ref(FrameID frame) {
+  auto& refs = frame_table_[frame.ID()].refs;
+  if (refs < kMaxFrameRefs) {
+    ++refs;
+  }
+}
+
+uint16_t BuddyMemoryManager::Unref(FrameID frame) {
+  auto& refs = frame_table_[frame.ID()].refs;
+  if (refs > 0 && refs < kMaxFrameRefs) {
+    --refs;
+  }
+  return refs;
 }
 
 // requires frames length to release, not only the pointer
-Error BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames) {
-  for (size_t i = 0; i < num_frames; ++i) {
-    SetBit(FrameID{start_frame.ID() + i}, false);
+Error BuddyMemoryManager::Free(FrameID start_frame, size_t num_frames) {
+  if (start_frame.ID() + num_frames > range_end_.ID()) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
   }
+  if (num_frames != 1) {
+    return FreeFrames(start_frame.ID(), num_frames);
+  }
+
+  auto& magazine = magazines_[CurrentCPU()];
+  if (magazine.count == kMagazineSize) {
+    DrainMagazine(magazine);
+  }
+  magazine.frames[magazine.count++] = start_frame.ID();
   return MAKE_ERROR(Error::kSuccess);
 }
 
-void BitmapMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames) {
-  for (size_t i = 0; i < num_frames; ++i) {
-    SetBit(FrameID{start_frame.ID() + i}, true);
+WithError<FrameID> BuddyMemoryManager::AllocateBlock(size_t num_frames) {
+  int order = 0;
+  while ((size_t{1} << order) < num_frames) {
+    ++order;
+  }
+  if (order > kMaxFrameOrder) {
+    return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+  }
+
+  // take the smallest free block which is large enough
+  int block_order = order;
+  while (block_order <= kMaxFrameOrder && free_lists_[block_order] == kNoFrame) {
+    ++block_order;
+  }
+  if (block_order > kMaxFrameOrder) {
+    return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+  }
+
+  const size_t frame = free_lists_[block_order];
+  RemoveFreeBlock(frame);
+  // split the block and give back the upper halves
+  while (block_order > order) {
+    --block_order;
+    PushFreeBlock(frame + (size_t{1} << block_order), block_order);
+  }
+
+  // give back the frames beyond num_frames
+  const size_t block_frames = size_t{1} << order;
+  if (num_frames < block_frames) {
+    FreeFrames(frame + num_frames, block_frames - num_frames);
+  }
+  return {FrameID{frame}, MAKE_ERROR(Error::kSuccess)};
+}
+
+Error BuddyMemoryManager::FreeFrames(size_t frame, size_t num_frames) {
+  // split the frames into aligned blocks of 2^order frames
+  while (num_frames > 0) {
+    int order = 0;
+    while (order < kMaxFrameOrder &&
+           frame % (size_t{2} << order) == 0 &&
+           (size_t{2} << order) <= num_frames) {
+      ++order;
+    }
+    FreeBlock(frame, order);
+    frame += size_t{1} << order;
+    num_frames -= size_t{1} << order;
   }
+  return MAKE_ERROR(Error::kSuccess);
 }
 
-void BitmapMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end) {
+void BuddyMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end,
+                                        FrameInfo* frame_table) {
   range_begin_ = range_begin;
-  range_end_ = range_end;
-} 
+  range_end_ = FrameID{std::min<size_t>(range_end.ID(), kFrameCount)};
+  frame_table_ = frame_table;
+  memset(frame_table_, 0, FrameTableBytes(range_end_));
+}
+
+size_t BuddyMemoryManager::FrameTableBytes(FrameID range_end) {
+  return std::min<size_t>(range_end.ID(), kFrameCount) * sizeof(FrameInfo);
+}
+
+MemoryStat BuddyMemoryManager::Stat() const {
+  size_t free_frames = 0;
+  for (int order = 0; order <= kMaxFrameOrder; ++order) {
+    free_frames += free_blocks_[order] << order;
+  }
+  size_t cached_frames = 0;
+  for (const auto& magazine : magazines_) {
+    cached_frames += magazine.count;
+  }
+  const size_t total = range_end_.ID() - range_begin_.ID();
+  return { total - free_frames - cached_frames - zeroed_count_, total,
+           cached_frames, zeroed_count_, free_blocks_ };
+}
 
-MemoryStat BitmapMemoryManager::Stat() const {
-  size_t sum = 0;
-  for (int i = range_begin_.ID() / kBitsPerMapLine;
-       i < range_end_.ID() / kBitsPerMapLine; ++i) {
-    sum += std::bitset<kBitsPerMapLine>(alloc_map_[i]).count();
+void BuddyMemoryManager::RefillMagazine(FrameMagazine& magazine) {
+  // one block of kMagazineBatch frames if possible, single frames otherwise
+  if (auto [ block, err ] = AllocateBlock(kMagazineBatch); !err) {
+    // pushed in reverse order so that the frames are handed out in address order
+    for (size_t i = kMagazineBatch; i > 0; --i) {
+      magazine.frames[magazine.count++] = block.ID() + i - 1;
+    }
+    return;
+  }
+  while (magazine.count < kMagazineBatch) {
+    auto [ frame, err ] = AllocateBlock(1);
+    if (err) {
+      return;
+    }
+    magazine.frames[magazine.count++] = frame.ID();
   }
-  return { sum, range_end_.ID() - range_begin_.ID() };
 }
 
-// return true: allocated, false: available
-bool BitmapMemoryManager::GetBit(FrameID frame) const {
-  auto line_index = frame.ID() / kBitsPerMapLine;
-  auto bit_index = frame.ID() % kBitsPerMapLine;
+void BuddyMemoryManager::DrainMagazine(FrameMagazine& magazine) {
+  // the oldest frames go back, the recently freed ones are likely in the cache
+  for (size_t i = 0; i < kMagazineBatch; ++i) {
+    FreeBlock(magazine.frames[i], 0);
+  }
+  magazine.count -= kMagazineBatch;
+  memmove(&magazine.frames[0], &magazine.frames[kMagazineBatch],
+          magazine.count * sizeof(magazine.frames[0]));
+}
 
-  return (alloc_map_[line_index] & (static_cast<MapLineType>(1) << bit_index)) != 0;
+void BuddyMemoryManager::DrainZeroedPool() {
+  while (zeroed_count_ > 0) {
+    FreeBlock(zeroed_frames_[--zeroed_count_], 0);
+  }
 }
 
-void BitmapMemoryManager::SetBit(FrameID frame, bool allocated) {
-  auto line_index = frame.ID() / kBitsPerMapLine;
-  auto bit_index = frame.ID() % kBitsPerMapLine;
+void BuddyMemoryManager::PushFreeBlock(size_t frame, int order) {
+  auto& info = frame_table_[frame];
+  info.order = order;
+  info.free = true;
+  info.prev = kNoFrame;
+  info.next = free_lists_[order];
+  if (info.next != kNoFrame) {
+    frame_table_[info.next].prev = frame;
+  }
+  free_lists_[order] = frame;
+  ++free_blocks_[order];
+}
 
-  if (allocated) {
-    // to mark allocated, get OR
-    alloc_map_[line_index] |= (static_cast<MapLineType>(1) << bit_index);
+void BuddyMemoryManager::RemoveFreeBlock(size_t frame) {
+  auto& info = frame_table_[frame];
+  if (info.prev != kNoFrame) {
+    frame_table_[info.prev].next = info.next;
   } else {
-    // to mark available, get AND with inverted bit string
-    alloc_map_[line_index] &= ~(static_cast<MapLineType>(1) << bit_index);
+    free_lists_[info.order] = info.next;
   }
+  if (info.next != kNoFrame) {
+    frame_table_[info.next].prev = info.prev;
+  }
+  info.free = false;
+  --free_blocks_[info.order];
+}
+
+void BuddyMemoryManager::FreeBlock(size_t frame, int order) {
+  // the buddy of a block differs from it only in the bit of its size
+  while (order < kMaxFrameOrder) {
+    const size_t buddy = frame ^ (size_t{1} << order);
+    if (buddy >= range_end_.ID() ||
+        !frame_table_[buddy].free || frame_table_[buddy].order != order) {
+      break;
+    }
+    RemoveFreeBlock(buddy);
+    frame &= ~(size_t{1} << order);
+    ++order;
+  }
+  PushFreeBlock(frame, order);
 }
 
 extern "C" caddr_t program_break, program_break_end;
 
 namespace {
-  char memory_manager_buf[sizeof(BitmapMemoryManager)];
+  char memory_manager_buf[sizeof(BuddyMemoryManager)];
+
+  // call f(begin, end) for each available memory in the UEFI memory map
+  template <class F>
+  void ForEachAvailableMemory(const MemoryMap& memory_map, F f) {
+    for (uintptr_t iter = reinterpret_cast<uintptr_t>(memory_map.buffer);
+         iter < reinterpret_cast<uintptr_t>(memory_map.buffer) + memory_map.map_size;
+         iter += memory_map.descriptor_size) {
+      auto desc = reinterpret_cast<const MemoryDescriptor*>(iter);
+      if (IsAvailable(static_cast<MemoryType>(desc->type))) {
+        f(desc->physical_start, desc->physical_start + desc->number_of_pages * kUEFIPageSize);
+      }
+    }
+  }
+
+  // the kernel heap grows in this region (PML4 entry 2) and pages are mapped as sbrk advances
+  const uint64_t kHeapRegionBegin = 0x0000'0100'0000'0000;
+  const uint64_t kHeapRegionEnd = 0x0000'0180'0000'0000;
 
   // initialize the necessary variables (program_break, program_break_end) for sbrk
-  Error InitializeHeap(BitmapMemoryManager& memory_manager) {
-    // memory frames to secure for heap
-    const int kHeapFrames = 64 * 512;
-    // allocate memory for heap by memory manager
-    const auto heap_start = memory_manager.Allocate(kHeapFrames);
-    if (heap_start.error) {
-      return heap_start.error;
+  // no frame is allocated until the heap is used
+  Error InitializeHeap() {
+    if (auto err = NewKernelPML4Entry(kHeapRegionBegin)) {
+      return err;
     }
 
-    // program_break is initialized to be the memory address of the heap start point
-    program_break = reinterpret_cast<caddr_t>(heap_start.value.ID() * kBytesPerFrame);
-    // program_break_end is initialized to be the memory address of the heap end point
-    program_break_end = program_break + kHeapFrames * kBytesPerFrame;
+    // program_break_end is the end of the mapped part of the heap
+    program_break = reinterpret_cast<caddr_t>(kHeapRegionBegin);
+    program_break_end = program_break;
 
     return MAKE_ERROR(Error::kSuccess);
   }
 }
 
-BitmapMemoryManager* memory_manager;
+BuddyMemoryManager* memory_manager;
+
+extern "C" int ResizeHeap(caddr_t new_break) {
+  const auto break_addr = reinterpret_cast<uint64_t>(new_break);
+  if (break_addr < kHeapRegionBegin || kHeapRegionEnd < break_addr) {
+    return -1;
+  }
+  const uint64_t new_end = (break_addr + kBytesPerFrame - 1) & ~(kBytesPerFrame - 1);
+  auto mapped_end = reinterpret_cast<uint64_t>(program_break_end);
+
+  while (mapped_end < new_end) {
+    if (MapKernelPage(mapped_end)) {
+      program_break_end = reinterpret_cast<caddr_t>(mapped_end);
+      return -1;
+    }
+    mapped_end += kBytesPerFrame;
+  }
+
+  // newlib malloc shrinks the heap only when the free memory at the top
+  // exceeds its trim threshold, so the frames are returned in bulk
+  const bool shrink = new_end < mapped_end;
+  while (new_end < mapped_end) {
+    mapped_end -= kBytesPerFrame;
+    UnmapKernelPage(mapped_end);
+  }
+  if (shrink) {
+    FlushKernelTLB();
+  }
+
+  program_break_end = reinterpret_cast<caddr_t>(mapped_end);
+  return 0;
+}
 
 void InitializeMemoryManager(const MemoryMap& memory_map) {
-  ::memory_manager = new(memory_manager_buf) BitmapMemoryManager;
+  ::memory_manager = new(memory_manager_buf) BuddyMemoryManager;
 
   // end address of the last avaialble memory descriptor
   uintptr_t available_end = 0;
-  // initialize memory manager by checking UEFI memory map
-  for (uintptr_t iter = reinterpret_cast<uintptr_t>(memory_map.buffer);
-       iter < reinterpret_cast<uintptr_t>(memory_map.buffer) + memory_map.map_size;
-       iter += memory_map.descriptor_size) {
-    auto desc = reinterpret_cast<MemoryDescriptor*>(iter);
-    // mark allocated if there is any gap between the last checked end address and the current desc start address
-    if (available_end < desc->physical_start) {
-      memory_manager->MarkAllocated(
-        FrameID{available_end / kBytesPerFrame},
-        (desc->physical_start - available_end) / kBytesPerFrame);
-    }
+  ForEachAvailableMemory(memory_map, [&](uintptr_t begin, uintptr_t end) {
+    available_end = std::max(available_end, end);
+  });
 
-    const auto physical_end = desc->physical_start + desc->number_of_pages * kUEFIPageSize;
-    if (IsAvailable(static_cast<MemoryType>(desc->type))) {
-      // if the current desc is available, extend available_end
-      available_end = physical_end;
-    } else {
-      // if not, mark allocated
-      memory_manager->MarkAllocated(
-        FrameID{desc->physical_start / kBytesPerFrame},
-        desc->number_of_pages * kUEFIPageSize / kBytesPerFrame);
+  // the first 1 MiB is kept out of the range for the AP startup trampoline (real mode code)
+  const uintptr_t range_begin = 1_MiB;
+  // the frame table takes the first available memory large enough for it
+  const size_t table_bytes =
+    BuddyMemoryManager::FrameTableBytes(FrameID{available_end / kBytesPerFrame});
+  // frames beyond the max physical memory of the memory manager are not in the table
+  const uintptr_t range_end = table_bytes / sizeof(FrameInfo) * kBytesPerFrame;
+  uintptr_t table_begin = 0;
+  ForEachAvailableMemory(memory_map, [&](uintptr_t begin, uintptr_t end) {
+    begin = std::max(begin, range_begin);
+    if (table_begin == 0 && begin + table_bytes <= end) {
+      table_begin = begin;
     }
+  });
+  if (table_begin == 0) {
+    Log(kError, "no memory for the frame table (%lu bytes)\n", table_bytes);
+    exit(1);
   }
+  const uintptr_t table_end =
+    (table_begin + table_bytes + kBytesPerFrame - 1) / kBytesPerFrame * kBytesPerFrame;
 
-  // set the range of the memory manager using the result of the memory map check
-  memory_manager->SetMemoryRange(FrameID{1}, FrameID{available_end / kBytesPerFrame});
+  memory_manager->SetMemoryRange(FrameID{range_begin / kBytesPerFrame},
+                                 FrameID{range_end / kBytesPerFrame},
+                                 reinterpret_cast<FrameInfo*>(table_begin));
+
+  // give the available frames except for the frame table to the memory manager
+  auto free_frames = [&](uintptr_t begin, uintptr_t end) {
+    begin = std::max(begin, range_begin);
+    end = std::min(end, range_end);
+    if (begin < end) {
+      memory_manager->Free(FrameID{begin / kBytesPerFrame}, (end - begin) / kBytesPerFrame);
+    }
+  };
+  ForEachAvailableMemory(memory_map, [&](uintptr_t begin, uintptr_t end) {
+    free_frames(begin, std::min(end, table_begin));
+    free_frames(std::max(begin, table_end), end);
+  });
 
   // initialize the value for heap allocation (sbrk in newlib_support.c)
-  if (auto err = InitializeHeap(*memory_manager)) {
+  if (auto err = InitializeHeap()) {
     Log(kError, "failed to allocate pages: %s at %s:%d\n",
         err.Name(), err.File(), err.Line());
     exit(1);
   }
-}
\ No newline at end of file
+}
+
+void ZeroFreeFrames() {
+  LockKernel();
+  while (!memory_manager->ZeroedPoolFull()) {
+    const size_t zeroed = memory_manager->ZeroedFrames();
+    auto [ frame, err ] = memory_manager->Allocate(1);
+    if (err) {
+      return;
+    }
+    if (memory_manager->ZeroedFrames() < zeroed) {
+      // no free frames left but the zeroed ones
+      memory_manager->PushZeroed(frame);
+      return;
+    }
+    // the frame is not visible to other CPUs until it is pushed to the pool
+    UnlockKernel();
+    ZeroFrameNonTemporal(frame.Frame());
+    LockKernel();
+    memory_manager->PushZeroed(frame);
+  }
+}
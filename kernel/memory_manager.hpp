@@ -1,10 +1,13 @@
 #pragma once
 
+#include <array>
 #include <cstddef>
+#include <cstdint>
 #include <limits>
 
 #include "error.hpp"
 #include "memory_map.hpp"
+#include "smp.hpp"
 
 // user-defined literals for KiB/MiB/GiB
 namespace {
@@ -41,24 +44,65 @@ class FrameID {
 // null frame id to be returned when there is not enough memory
 static const FrameID kNullFrame{std::numeric_limits<size_t>::max()};
 
+// the buddy allocator manages blocks of 2^order frames (order 0 .. kMaxFrameOrder)
+static const int kMaxFrameOrder = 18; // 1 GiB
+
 struct MemoryStat {
   size_t allocated_frames;
   size_t total_frames;
+  // free frames kept in the per-CPU magazines
+  size_t cached_frames;
+  // free frames filled with zeros ahead by the idle tasks
+  size_t zeroed_frames;
+  // number of free blocks of each order
+  std::array<size_t, kMaxFrameOrder + 1> free_blocks;
+};
+
+// state of a physical frame, one entry per frame in the frame table
+struct FrameInfo {
+  // links of the free list, valid in the first frame of a free block
+  uint32_t prev, next;
+  // order of the free block starting at this frame
+  uint8_t order;
+  bool free;
+  // number of app page maps mapping the frame (the first frame for a 2 MiB page)
+  uint16_t refs;
 };
 
-class BitmapMemoryManager {
+class BuddyMemoryManager {
   public:
     // constructor
-    BitmapMemoryManager();
+    BuddyMemoryManager();
 
     // allocate and free
+    // any number of frames can be allocated, the block is rounded up to
+    // a power of 2 and the rest is given back
+    // single frames come from and go to the magazine of the running CPU
     WithError<FrameID> Allocate(size_t num_frames);
     Error Free(FrameID start_frame, size_t num_frames);
-    // mark allocated
-    void MarkAllocated(FrameID start_frame, size_t num_frames);
-
-    // set the range of the memory manager
-    void SetMemoryRange(FrameID range_begin, FrameID range_end);
+    // allocate a frame filled with zeros, taken from the pool of zeroed frames
+    // if it is not empty, so that the caller does not need to clear it
+    WithError<FrameID> AllocateZeroed();
+    // put an allocated frame filled with zeros into the pool
+    void PushZeroed(FrameID frame);
+    size_t ZeroedFrames() const { return zeroed_count_; }
+    bool ZeroedPoolFull() const { return zeroed_count_ == kZeroedPoolSize; }
+
+    // reference counts of the frames mapped to the address spaces of apps
+    // the page maps sharing a frame take a reference each, and the last one frees it
+    // a count reaching kMaxFrameRefs sticks there: the frame is leaked rather than
+    // freed while it is still mapped
+    static const uint16_t kMaxFrameRefs = 0xffff;
+    void Ref(FrameID frame);
+    // drop a reference, return the number of references left
+    uint16_t Unref(FrameID frame);
+    uint16_t RefCount(FrameID frame) const { return frame_table_[frame.ID()].refs; }
+
+    // set the range of the memory manager and the frame table for it
+    // every frame is allocated until Free is called for it
+    void SetMemoryRange(FrameID range_begin, FrameID range_end, FrameInfo* frame_table);
+    // bytes of the frame table for the frames below range_end
+    static size_t FrameTableBytes(FrameID range_end);
 
     MemoryStat Stat() const;
 
@@ -67,23 +111,50 @@ class BitmapMemoryManager {
     static const auto kMaxPhysicalMemoryBytes{128_GiB};
     // number of frames to keep kMaxPhysicalMemoryBytes
     static const auto kFrameCount{kMaxPhysicalMemoryBytes / kBytesPerFrame};
-
-    // a line in the memory bitmap (32 bit per line)
-    using MapLineType = unsigned long;
-    // number of the frames to keep in a line of the bitmap
-    // (not that all the bits in MapLineType are used)
-    static const size_t kBitsPerMapLine{8 * sizeof(MapLineType)};
-
-    // bitmap to keep the memory allocation status
-    std::array<MapLineType, kFrameCount / kBitsPerMapLine> alloc_map_;
+    // end of a free list
+    static const uint32_t kNoFrame{std::numeric_limits<uint32_t>::max()};
+    // a magazine is refilled and drained by kMagazineBatch frames
+    static const int kMagazineBatchOrder{4};
+    static const size_t kMagazineBatch{size_t{1} << kMagazineBatchOrder};
+    static const size_t kMagazineSize{4 * kMagazineBatch};
+    // frames zeroed ahead at most: 1 MiB
+    static const size_t kZeroedPoolSize{256};
+
+    // a per-CPU stack of free single frames in front of the free lists
+    struct FrameMagazine {
+      std::array<uint32_t, kMagazineSize> frames;
+      size_t count;
+    };
+
+    // frame_table_[i] is the state of the frame i
+    FrameInfo* frame_table_;
+    // first frame of the free blocks of each order
+    std::array<uint32_t, kMaxFrameOrder + 1> free_lists_;
+    std::array<size_t, kMaxFrameOrder + 1> free_blocks_;
+    std::array<FrameMagazine, kMaxCPUs> magazines_;
+    std::array<uint32_t, kZeroedPoolSize> zeroed_frames_;
+    size_t zeroed_count_;
     // start point of the memory range under this memory manager
     FrameID range_begin_;
     // end point of the memory range under this memory manager
     FrameID range_end_;
 
-    bool GetBit(FrameID frame) const;
-    void SetBit(FrameID frame, bool allocated);
+    WithError<FrameID> AllocateBlock(size_t num_frames);
+    Error FreeFrames(size_t frame, size_t num_frames);
+    void RefillMagazine(FrameMagazine& magazine);
+    void DrainMagazine(FrameMagazine& magazine);
+    // give the zeroed frames back to the free lists when the memory runs out
+    void DrainZeroedPool();
+
+    void PushFreeBlock(size_t frame, int order);
+    void RemoveFreeBlock(size_t frame);
+    // free a block of 2^order frames, merging it with its free buddies
+    void FreeBlock(size_t frame, int order);
 };
 
-extern BitmapMemoryManager* memory_manager;
-void InitializeMemoryManager(const MemoryMap& memory_map);
\ No newline at end of file
+extern BuddyMemoryManager* memory_manager;
+void InitializeMemoryManager(const MemoryMap& memory_map);
+
+// fill the pool of zeroed frames of memory_manager while the running CPU has nothing to do
+// called by the idle task of each CPU, the kernel lock is released while a frame is zeroed
+void ZeroFreeFrames();
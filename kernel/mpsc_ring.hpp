@@ -0,0 +1,117 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+// fixed-capacity lock-free queue with multiple producers and a single consumer
+// Push never allocates memory, so interrupt handlers and other CPUs can use it
+// each cell has a sequence number telling whether it is free for the producer
+// at a position (seq == pos) or filled for the consumer (seq == pos + 1)
+template <class T, size_t N>
+class MPSCRing {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of 2");
+
+  public:
+    MPSCRing() {
+      for (size_t i = 0; i < N; ++i) {
+        cells_[i].seq.store(i, std::memory_order_relaxed);
+      }
+    }
+
+    // return false if the ring is full (the value is dropped and counted)
+    bool Push(const T& value) {
+      size_t pos = tail_.load(std::memory_order_relaxed);
+      Cell* cell;
+      while (true) {
+        cell = &cells_[pos & (N - 1)];
+        // a locked cell is filled, so it counts as full here
+        const size_t seq = cell->seq.load(std::memory_order_acquire) & ~kMergingBit;
+        const auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+          if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            break;
+          }
+        } else if (diff < 0) {
+          overflows_.fetch_add(1, std::memory_order_relaxed);
+          return false;
+        } else {
+          pos = tail_.load(std::memory_order_relaxed);
+        }
+      }
+
+      cell->value = value;
+      cell->seq.store(pos + 1, std::memory_order_release);
+      return true;
+    }
+
+    // merge the value into the newest queued value if merge(queued, value) returns
+    // true, otherwise push it as a new value
+    // the newest value is locked by kMergingBit while it is rewritten
+    template <class Merge>
+    bool PushOrMerge(const T& value, Merge merge) {
+      const size_t pos = tail_.load(std::memory_order_acquire);
+      if (pos > 0) {
+        Cell& cell = cells_[(pos - 1) & (N - 1)];
+        size_t filled = pos;
+        if (cell.seq.compare_exchange_strong(filled, pos | kMergingBit,
+                                             std::memory_order_acquire)) {
+          // another producer may have queued a value after the locked one
+          const bool merged = tail_.load(std::memory_order_relaxed) == pos &&
+                              merge(cell.value, value);
+          cell.seq.store(pos, std::memory_order_release);
+          if (merged) {
+            return true;
+          }
+        }
+      }
+      return Push(value);
+    }
+
+    // only one consumer may call Pop at a time
+    std::optional<T> Pop() {
+      Cell& cell = cells_[head_ & (N - 1)];
+      // lock the cell so that PushOrMerge does not rewrite it while it is copied
+      size_t filled = head_ + 1;
+      if (!cell.seq.compare_exchange_strong(filled, filled | kMergingBit,
+                                            std::memory_order_acquire)) {
+        return std::nullopt; // empty, or a producer is still writing the value
+      }
+
+      T value = cell.value;
+      cell.seq.store(head_ + N, std::memory_order_release);
+      ++head_;
+      return value;
+    }
+
+    // number of queued values, may be stale if producers are pushing
+    size_t Size() const {
+      return tail_.load(std::memory_order_relaxed) - head_;
+    }
+
+    bool Empty() const {
+      return cells_[head_ & (N - 1)].seq.load(std::memory_order_acquire) != head_ + 1;
+    }
+
+    // number of values dropped because the ring was full
+    uint64_t Overflows() const {
+      return overflows_.load(std::memory_order_relaxed);
+    }
+
+    static constexpr size_t Capacity() { return N; }
+
+  private:
+    static constexpr size_t kMergingBit = size_t{1} << (sizeof(size_t) * 8 - 1);
+
+    struct Cell {
+      std::atomic<size_t> seq;
+      T value;
+    };
+
+    std::array<Cell, N> cells_;
+    std::atomic<size_t> tail_{0};
+    size_t head_{0};
+    std::atomic<uint64_t> overflows_{0};
+};
@@ -6,13 +6,17 @@ void _exit(void) {
 }
 
 // malloc/free of Newlib depend on program_break and program_break_end
+// [heap begin, program_break_end) is mapped (rounded up to pages)
 caddr_t program_break, program_break_end;
 
+// map or unmap the kernel heap so that it ends at new_break (memory_manager.cpp)
+int ResizeHeap(caddr_t new_break);
+
 // update program break
 caddr_t sbrk(int incr) {
   // if program break is 0, the variable is not initialized correctly
-  // if program break + incr >= program_break_end, there is no enough memory left
-  if (program_break == 0 || program_break + incr >= program_break_end) {
+  // if the heap cannot be mapped up to program break + incr, there is no enough memory left
+  if (program_break == 0 || ResizeHeap(program_break + incr) != 0) {
     errno = ENOMEM;
     return (caddr_t)-1;
   }
@@ -1,10 +1,15 @@
 #include "paging.hpp"
 
+#include <algorithm>
 #include <array>
+#include <cpuid.h>
 #include <cstdint>
+#include <optional>
 
 #include "asmfunc.h"
+#include "logger.hpp"
 #include "memory_manager.hpp"
+#include "smp.hpp"
 #include "task.hpp"
 
 namespace {
@@ -12,39 +17,274 @@ namespace {
   const uint64_t kPageSize2M = 512 * kPageSize4K;
   const uint64_t kPageSize1G = 512 * kPageSize2M;
 
-  // the number of the page directory to be allocated staticly
-  // a page directory contains 512 pages, a page is 2MB
-  // hence, kPageDirectoryCount * 512 * 2MB = 64GB virtual addresses are mapped
-  const size_t kPageDirectoryCount = 64;
+  // the identity mapping covers the physical memory in the UEFI memory map,
+  // at least the first 4 GiB (local APIC, PCI MMIO) and at most a PML4 entry
+  const uint64_t kMinIdentityMapBytes = 4 * kPageSize1G;
+  const uint64_t kMaxIdentityMapBytes = 512 * kPageSize1G;
 
   alignas(kPageSize4K) std::array<uint64_t, 512> pml4_table;
   alignas(kPageSize4K) std::array<uint64_t, 512> pdp_table; // not an array since we prepare only one pdp here
-  alignas(kPageSize4K) std::array<std::array<uint64_t, 512>, kPageDirectoryCount> page_directory;
+
+  bool Supports1GiBPages() {
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid_max(0x80000000, nullptr) < 0x80000001) {
+      return false;
+    }
+    __cpuid(0x80000001, eax, ebx, ecx, edx);
+    return edx & (1u << 26); // PDPE1GB
+  }
+
+  uint64_t IdentityMapBytes(const MemoryMap& memory_map) {
+    uint64_t end = kMinIdentityMapBytes;
+    for (uintptr_t iter = reinterpret_cast<uintptr_t>(memory_map.buffer);
+         iter < reinterpret_cast<uintptr_t>(memory_map.buffer) + memory_map.map_size;
+         iter += memory_map.descriptor_size) {
+      auto desc = reinterpret_cast<const MemoryDescriptor*>(iter);
+      end = std::max(end, desc->physical_start + desc->number_of_pages * kUEFIPageSize);
+    }
+    if (end > kMaxIdentityMapBytes) {
+      Log(kWarn, "physical memory above %lu GiB is not mapped\n",
+          kMaxIdentityMapBytes / kPageSize1G);
+      end = kMaxIdentityMapBytes;
+    }
+    return (end + kPageSize1G - 1) & ~(kPageSize1G - 1);
+  }
+
+  // take pages from the conventional memory of the UEFI memory map before the memory
+  // manager is initialized, the descriptor is shrunk so that the memory manager skips them
+  // UEFI still maps every physical page, and its page maps are not in the conventional memory
+  uintptr_t TakeBootPages(const MemoryMap& memory_map, size_t num_pages) {
+    for (uintptr_t iter = reinterpret_cast<uintptr_t>(memory_map.buffer);
+         iter < reinterpret_cast<uintptr_t>(memory_map.buffer) + memory_map.map_size;
+         iter += memory_map.descriptor_size) {
+      auto desc = reinterpret_cast<MemoryDescriptor*>(iter);
+      if (desc->type == MemoryType::kEfiConventionalMemory &&
+          desc->physical_start >= 1024 * 1024 && desc->number_of_pages >= num_pages) {
+        const uintptr_t pages = desc->physical_start;
+        desc->physical_start += num_pages * kUEFIPageSize;
+        desc->number_of_pages -= num_pages;
+        return pages;
+      }
+    }
+    return 0;
+  }
+
+  const uint64_t kCR4PCIDE = 1ul << 17;
+  // loading CR3 with this bit keeps the TLB entries of the PCID
+  const uint64_t kCR3NoFlush = 1ul << 63;
+  // PCID 0 is the kernel, 1 .. kNumPCIDs - 1 are given to the address spaces of apps
+  // the address spaces created while every PCID is in use share kSharedPCID,
+  // whose TLB entries are flushed every time it is loaded
+  const uint64_t kNumPCIDs = 256;
+  const uint64_t kSharedPCID = kNumPCIDs;
+  const uint64_t kInvalidPCIDOwner = ~0ul;
+
+  bool pcid_enabled, invpcid_supported;
+  // owner of each PCID: a number unique to each address space (0: free or the kernel)
+  std::array<uint64_t, kNumPCIDs> pcid_owner;
+  uint64_t last_pcid_owner;
+  // owner of each PCID whose TLB entries may be on each CPU
+  std::array<std::array<uint64_t, kNumPCIDs>, kMaxCPUs> cached_pcid_owner;
+
+  bool SupportsPCID() {
+    unsigned int eax, ebx, ecx, edx;
+    __cpuid(1, eax, ebx, ecx, edx);
+    return ecx & (1u << 17); // PCID
+  }
+
+  bool SupportsINVPCID() {
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid_max(0, nullptr) < 7) {
+      return false;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return ebx & (1u << 10); // INVPCID
+  }
+
+  // called after the running CPU invalidated pages of the running address space
+  // the other CPUs flush the PCID when they load it next, even for an app without threads
+  // as it may have run on them before (the CPUs running threads of the app now are
+  // handled by ShootdownTLB)
+  void ChangePCIDOwner() {
+    const uint64_t pcid = GetCR3() & kCR3PCIDMask;
+    if (!pcid_enabled || pcid == 0 || pcid >= kNumPCIDs) {
+      return;
+    }
+    pcid_owner[pcid] = ++last_pcid_owner;
+    cached_pcid_owner[CurrentCPU()][pcid] = pcid_owner[pcid];
+  }
 }
 
-void SetupIdentityPageTable() {
+void SetupIdentityPageTable(const MemoryMap& memory_map) {
+  const uint64_t map_bytes = IdentityMapBytes(memory_map);
+  const size_t num_pdp_entries = map_bytes / kPageSize1G;
+
   pml4_table[0] = reinterpret_cast<uint64_t>(&pdp_table[0]) | 0x03;
-  for (int i_pdpt = 0; i_pdpt < page_directory.size(); ++i_pdpt) {
-    pdp_table[i_pdpt] = reinterpret_cast<uint64_t>(&page_directory[i_pdpt]) | 0x03;
-    for (int i_pd = 0; i_pd < 512; ++i_pd) {
-      page_directory[i_pdpt][i_pd] = i_pdpt * kPageSize1G + i_pd * kPageSize2M | 0x83;
+  if (Supports1GiBPages()) {
+    for (size_t i_pdpt = 0; i_pdpt < num_pdp_entries; ++i_pdpt) {
+      pdp_table[i_pdpt] = i_pdpt * kPageSize1G | 0x83;
+    }
+  } else {
+    // a page directory of 2 MiB pages for each 1 GiB
+    const auto page_directory = reinterpret_cast<std::array<uint64_t, 512>*>(
+        TakeBootPages(memory_map, num_pdp_entries));
+    if (page_directory == nullptr) {
+      Log(kError, "no memory for the identity mapping\n");
+      while (true) __asm__("hlt");
+    }
+    for (size_t i_pdpt = 0; i_pdpt < num_pdp_entries; ++i_pdpt) {
+      pdp_table[i_pdpt] = reinterpret_cast<uint64_t>(&page_directory[i_pdpt]) | 0x03;
+      for (int i_pd = 0; i_pd < 512; ++i_pd) {
+        page_directory[i_pdpt][i_pd] = i_pdpt * kPageSize1G + i_pd * kPageSize2M | 0x83;
+      }
     }
   }
+  Log(kInfo, "identity mapping: %lu GiB with %s pages\n",
+      num_pdp_entries, Supports1GiBPages() ? "1 GiB" : "2 MiB");
 
   ResetCR3();
   SetCR0(GetCR0() & 0xfffeffff); // Clear WP
 }
 
-void InitializePaging() {
-  SetupIdentityPageTable();
+void InitializePaging(const MemoryMap& memory_map) {
+  SetupIdentityPageTable(memory_map);
+
+  pcid_enabled = SupportsPCID();
+  invpcid_supported = pcid_enabled && SupportsINVPCID();
+  EnablePCID();
+  Log(kInfo, "PCID: %s, INVPCID: %s\n",
+      pcid_enabled ? "enabled" : "not supported",
+      invpcid_supported ? "supported" : "not supported");
 }
 
 void ResetCR3() {
-  SetCR3(reinterpret_cast<uint64_t>(&pml4_table[0]));
+  SetCR3(CR3ToLoad(reinterpret_cast<uint64_t>(&pml4_table[0])));
+}
+
+void EnablePCID() {
+  if (pcid_enabled) {
+    SetCR4(GetCR4() | kCR4PCIDE);
+  }
+}
+
+uint64_t AddressSpaceCR3(PageMapEntry* pml4) {
+  const auto cr3 = reinterpret_cast<uint64_t>(pml4);
+  if (!pcid_enabled) {
+    return cr3;
+  }
+  for (uint64_t pcid = 1; pcid < kNumPCIDs; ++pcid) {
+    if (pcid_owner[pcid] == 0) {
+      pcid_owner[pcid] = ++last_pcid_owner;
+      return cr3 | pcid;
+    }
+  }
+  return cr3 | kSharedPCID;
+}
+
+void ReleasePCID(uint64_t cr3) {
+  const uint64_t pcid = cr3 & kCR3PCIDMask;
+  if (pcid_enabled && 0 < pcid && pcid < kNumPCIDs) {
+    // the CPUs flush the stale entries when the PCID is given to a new address space
+    pcid_owner[pcid] = 0;
+  }
+}
+
+uint64_t CR3ToLoad(uint64_t cr3) {
+  cr3 &= ~kCR3NoFlush;
+  const uint64_t pcid = cr3 & kCR3PCIDMask;
+  if (!pcid_enabled || pcid >= kNumPCIDs) {
+    return cr3;
+  }
+
+  auto& cached_owner = cached_pcid_owner[CurrentCPU()][pcid];
+  if (cached_owner == pcid_owner[pcid]) {
+    return cr3 | kCR3NoFlush;
+  }
+  cached_owner = pcid_owner[pcid];
+  return cr3;
+}
+
+void FlushTLB() {
+  if (!pcid_enabled) {
+    SetCR3(GetCR3());
+  } else if (invpcid_supported) {
+    const uint64_t descriptor[2] = {0, 0};
+    InvalidatePCID(2, descriptor); // all PCIDs
+  } else {
+    // every PCID but the running one is flushed when it is loaded next
+    auto& cached_owner = cached_pcid_owner[CurrentCPU()];
+    cached_owner.fill(kInvalidPCIDOwner);
+    const auto cr3 = GetCR3();
+    if (const uint64_t pcid = cr3 & kCR3PCIDMask; pcid < kNumPCIDs) {
+      cached_owner[pcid] = pcid_owner[pcid];
+    }
+    SetCR3(cr3);
+  }
+}
+
+PageMapEntry* CurrentPML4() {
+  return PML4Of(GetCR3());
 }
 
 namespace {
 
+// frame mapped by a page map entry
+FrameID FrameOf(const PageMapEntry& entry) {
+  return FrameID{reinterpret_cast<uintptr_t>(entry.Pointer()) / kBytesPerFrame};
+}
+
+const size_t kFramesPer2M = kPageSize2M / kBytesPerFrame;
+
+// number of frames mapped by a page table entry or a 2 MiB page
+size_t FramesOf(const PageMapEntry& entry) {
+  return entry.bits.huge_page ? kFramesPer2M : 1;
+}
+
+// a 2 MiB page takes a reference on each of its frames, so that it can be split
+// into 4 KiB pages without changing the counts
+void RefPage(const PageMapEntry& entry) {
+  const FrameID frame = FrameOf(entry);
+  for (size_t i = 0; i < FramesOf(entry); ++i) {
+    memory_manager->Ref(FrameID{frame.ID() + i});
+  }
+}
+
+// drop the references of the page and free the frames which no other address space maps
+// (shared pages are read-only)
+Error UnrefPage(const PageMapEntry& entry) {
+  const FrameID frame = FrameOf(entry);
+  const size_t num_frames = FramesOf(entry);
+  size_t num_unused = 0;
+  for (size_t i = 0; i < num_frames; ++i) {
+    if (memory_manager->Unref(FrameID{frame.ID() + i}) == 0) {
+      ++num_unused;
+    }
+  }
+  if (num_unused == num_frames) {
+    return memory_manager->Free(frame, num_frames);
+  }
+  // some 4 KiB pages of a split 2 MiB page are still mapped by another address space
+  for (size_t i = 0; num_unused > 0 && i < num_frames; ++i) {
+    if (memory_manager->RefCount(FrameID{frame.ID() + i}) == 0) {
+      if (auto err = memory_manager->Free(FrameID{frame.ID() + i}, 1)) {
+        return err;
+      }
+      --num_unused;
+    }
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+// largest reference count of the frames of the page
+uint16_t RefCountOfPage(const PageMapEntry& entry) {
+  const FrameID frame = FrameOf(entry);
+  uint16_t refs = 0;
+  for (size_t i = 0; i < FramesOf(entry); ++i) {
+    refs = std::max(refs, memory_manager->RefCount(FrameID{frame.ID() + i}));
+  }
+  return refs;
+}
+
 WithError<PageMapEntry*> SetNewPageMapIfNotPresent(PageMapEntry& entry) {
   if (entry.bits.present) {
     return { entry.Pointer(), MAKE_ERROR(Error::kSuccess) };
@@ -66,6 +306,7 @@ WithError<size_t> SetupPageMap(PageMapEntry* page_map, int page_map_level, Linea
   while (num_4kpages > 0) {
     const auto entry_index = addr.Part(page_map_level);
 
+    const bool mapped = page_map[entry_index].bits.present;
     auto [ child_map, err ] = SetNewPageMapIfNotPresent(page_map[entry_index]);
     if (err) {
       return { num_4kpages, err };
@@ -73,6 +314,9 @@ WithError<size_t> SetupPageMap(PageMapEntry* page_map, int page_map_level, Linea
     page_map[entry_index].bits.user = 1;
 
     if (page_map_level == 1) {
+      if (!mapped) {
+        memory_manager->Ref(FrameOf(page_map[entry_index]));
+      }
       page_map[entry_index].bits.writable = writable;
       --num_4kpages;
     } else {
@@ -105,18 +349,15 @@ Error CleanPageMap(PageMapEntry* page_map, int page_map_level, LinearAddress4Lev
       continue;
     }
 
-    if (page_map_level > 1) {
+    if (page_map_level > 1 && !entry.bits.huge_page) {
       if (auto err = CleanPageMap(entry.Pointer(), page_map_level - 1, addr)) {
         return err;
       }
-    }
-
-    if (entry.bits.writable) {
-      const auto entry_addr = reinterpret_cast<uintptr_t>(entry.Pointer());
-      const FrameID map_frame{entry_addr / kBytesPerFrame};
-      if (auto err = memory_manager->Free(map_frame, 1)) {
+      if (auto err = FreePageMap(entry.Pointer())) {
         return err;
       }
+    } else if (auto err = UnrefPage(entry)) {
+      return err;
     }
     page_map[i].data = 0;
   }
@@ -124,66 +365,284 @@ Error CleanPageMap(PageMapEntry* page_map, int page_map_level, LinearAddress4Lev
   return MAKE_ERROR(Error::kSuccess);
 }
 
-const FileMapping* FindFileMapping(const std::vector<FileMapping>& fmaps,
-                                  uint64_t causal_vaddr) {
-  for (const FileMapping& m : fmaps) {
-    if (m.vaddr_begin <= causal_vaddr && causal_vaddr < m.vaddr_end) {
-      return &m;
+// map a 2 MiB page at addr (2 MiB aligned) for the app
+// fill(page) initializes the page through the identity mapping before the page gets visible
+// fails if the page directory entry is in use (4 KiB pages are mapped around addr)
+// or there is no free 2 MiB block, then the caller falls back to 4 KiB pages
+// page map of the running app at the level containing the entry for addr
+// the page maps above it are created if not present
+WithError<PageMapEntry*> PageMapOf(LinearAddress4Level a, int page_map_level) {
+  auto table = CurrentPML4();
+  for (int level = 4; level > page_map_level; --level) {
+    auto& entry = table[a.Part(level)];
+    auto [ child_map, err ] = SetNewPageMapIfNotPresent(entry);
+    if (err) {
+      return { nullptr, err };
     }
+    entry.bits.user = 1;
+    entry.bits.writable = 1;
+    table = child_map;
   }
-  return nullptr;
+  return { table, MAKE_ERROR(Error::kSuccess) };
 }
 
-Error PreparePageCache(FileDescriptor& fd, const FileMapping& m,
-                       uint64_t causal_vaddr) {
-  LinearAddress4Level page_vaddr{causal_vaddr};
-  page_vaddr.parts.offset = 0;
-  if (auto err = SetupPageMaps(page_vaddr, 1)) {
+template <class Fill>
+Error SetupHugePage(uint64_t addr, Fill fill) {
+  LinearAddress4Level a{addr};
+  auto [ table, table_err ] = PageMapOf(a, 2);
+  if (table_err) {
+    return table_err;
+  }
+
+  auto& entry = table[a.Part(2)];
+  if (entry.bits.present) {
+    return MAKE_ERROR(Error::kAlreadyAllocated);
+  }
+  auto [ frame, err ] = memory_manager->Allocate(kPageSize2M / kBytesPerFrame);
+  if (err) {
     return err;
   }
+  fill(frame.Frame());
 
-  const long file_offset = page_vaddr.value - m.vaddr_begin;
-  void* page_cache = reinterpret_cast<void*>(page_vaddr.value);
-  fd.Load(page_cache, 4096, file_offset);
+  entry.data = 0;
+  entry.SetPointer(reinterpret_cast<PageMapEntry*>(frame.Frame()));
+  entry.bits.present = 1;
+  entry.bits.writable = 1;
+  entry.bits.user = 1;
+  entry.bits.huge_page = 1;
+  RefPage(entry);
   return MAKE_ERROR(Error::kSuccess);
 }
 
-Error SetPageContent(PageMapEntry* table, int part,
-                       LinearAddress4Level addr, PageMapEntry* content) {
-  if (part == 1) {
-    const auto i = addr.Part(part);
-    table[i].SetPointer(content);
-    table[i].bits.writable = 1;
-    InvalidateTLB(addr.value);
-    return MAKE_ERROR(Error::kSuccess);
+// map a zeroed 4 KiB page at addr (4 KiB aligned, not mapped yet) for the app
+// fill(page) initializes the page through the identity mapping before the page gets visible
+template <class Fill>
+Error SetupPage(uint64_t addr, Fill fill) {
+  LinearAddress4Level a{addr};
+  auto [ table, table_err ] = PageMapOf(a, 1);
+  if (table_err) {
+    return table_err;
   }
 
-  const auto i = addr.Part(part);
-  return SetPageContent(table[i].Pointer(), part - 1, addr, content);
+  auto [ frame, err ] = memory_manager->AllocateZeroed();
+  if (err) {
+    return err;
+  }
+  fill(frame.Frame());
+
+  auto& entry = table[a.Part(1)];
+  entry.data = 0;
+  entry.SetPointer(reinterpret_cast<PageMapEntry*>(frame.Frame()));
+  entry.bits.present = 1;
+  entry.bits.writable = 1;
+  entry.bits.user = 1;
+  memory_manager->Ref(frame);
+  return MAKE_ERROR(Error::kSuccess);
 }
 
-Error CopyOnePage(uint64_t causal_addr) {
-  auto [ p, err ] = NewPageMap();
+// first address of the 2 MiB page containing addr if the page is inside [begin, end)
+std::optional<uint64_t> HugePageIn(uint64_t addr, uint64_t begin, uint64_t end) {
+  const uint64_t page = addr & ~(kPageSize2M - 1);
+  if (page < begin || end < page + kPageSize2M) {
+    return std::nullopt;
+  }
+  return page;
+}
+
+// entry mapping the page at addr: a page table entry, or a page directory entry
+// of a 2 MiB page (huge_page is set), nullptr if a page map on the way is not present
+PageMapEntry* FindPageTableEntry(uint64_t addr) {
+  LinearAddress4Level a{addr};
+  auto table = CurrentPML4();
+  for (int level = 4; level > 1; --level) {
+    auto& entry = table[a.Part(level)];
+    if (!entry.bits.present) {
+      return nullptr;
+    }
+    if (entry.bits.huge_page) {
+      return &entry;
+    }
+    table = entry.Pointer();
+  }
+  return &table[a.Part(1)];
+}
+
+// replace the 2 MiB page of entry with a page table mapping the same frames with 4 KiB pages
+// the frames keep their reference counts (see RefPage)
+Error SplitHugePage(PageMapEntry& entry) {
+  auto [ table, err ] = NewPageMap();
   if (err) {
     return err;
   }
-  const auto aligned_addr = causal_addr & 0xffff'ffff'ffff'f000;
-  memcpy(p, reinterpret_cast<void*>(aligned_addr), 4096);
-  return SetPageContent(reinterpret_cast<PageMapEntry*>(GetCR3()), 4,
-                        LinearAddress4Level{causal_addr}, p);
+  const FrameID frame = FrameOf(entry);
+  for (size_t i = 0; i < kFramesPer2M; ++i) {
+    table[i].SetPointer(reinterpret_cast<PageMapEntry*>(FrameID{frame.ID() + i}.Frame()));
+    table[i].bits.present = 1;
+    table[i].bits.writable = entry.bits.writable;
+    table[i].bits.user = 1;
+  }
+
+  entry.data = 0;
+  entry.SetPointer(table);
+  entry.bits.present = 1;
+  entry.bits.writable = 1;
+  entry.bits.user = 1;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+// give a private copy of the read-only page at causal_addr to the running address space
+// the page is made writable without copying if no other address space maps it
+Error CopyOnePage(uint64_t causal_addr) {
+  auto entry = FindPageTableEntry(causal_addr);
+  if (entry == nullptr || !entry->bits.present) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+
+  const FrameID frame = FrameOf(*entry);
+  if (RefCountOfPage(*entry) <= 1) {
+    // no other address space maps the page, take it over without copying
+    // (the other CPUs fault on their read-only entries and find the page writable)
+    entry->bits.writable = 1;
+    InvalidateTLB(causal_addr);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  const size_t bytes = entry->bits.huge_page ? kPageSize2M : kPageSize4K;
+  // the copy overwrites the frame, so it does not need to be zeroed
+  auto [ copy, err ] = memory_manager->Allocate(bytes / kBytesPerFrame);
+  if (err && entry->bits.huge_page) {
+    // no free 2 MiB block: copy only the 4 KiB page written
+    if (auto split_err = SplitHugePage(*entry)) {
+      return split_err;
+    }
+    InvalidateTLB(causal_addr);
+    return CopyOnePage(causal_addr);
+  } else if (err) {
+    return err;
+  }
+  memcpy(copy.Frame(), frame.Frame(), bytes);
+  if (auto unref_err = UnrefPage(*entry)) {
+    return unref_err;
+  }
+
+  entry->SetPointer(reinterpret_cast<PageMapEntry*>(copy.Frame()));
+  entry->bits.writable = 1;
+  RefPage(*entry);
+  InvalidateTLB(causal_addr);
+  ChangePCIDOwner();
+  // the other threads of the app must not keep writing to the old frame
+  auto& group = task_manager->CurrentTask().Group();
+  if (const auto cpu_mask = task_manager->OtherCPUsRunning(group); cpu_mask != 0) {
+    ShootdownTLB(cpu_mask, causal_addr);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+// pages mapped by a fault at most: 256 KiB
+const size_t kMaxFaultAroundPages = 64;
+// pages mapped by a fault of a file mapping at least, as reading ahead costs little
+const size_t kFileFaultAroundPages = 4;
+
+// demand paging region or file mapping of the running app
+struct PagingRegion {
+  uint64_t begin, end;
+  FaultAround& fault_around;
+  FileDescriptor* fd; // nullptr for the demand paging region
+};
+
+std::optional<PagingRegion> FindPagingRegion(Task& task, uint64_t vaddr) {
+  if (task.DPagingBegin() <= vaddr && vaddr < task.DPagingEnd()) {
+    return PagingRegion{task.DPagingBegin(), task.DPagingEnd(),
+                        task.Group().dpaging_fault_around, nullptr};
+  }
+  for (FileMapping& m : task.FileMaps()) {
+    if (m.vaddr_begin <= vaddr && vaddr < m.vaddr_end) {
+      return PagingRegion{m.vaddr_begin, m.vaddr_end,
+                          m.fault_around, task.Files()[m.fd].get()};
+    }
+  }
+  return std::nullopt;
+}
+
+// number of pages to map from the faulting page
+size_t FaultAroundPages(FaultAround& fa, uint64_t page, size_t min_pages) {
+  switch (fa.advice) {
+  case PageAdvice::kRandom:
+    fa.pages = 1;
+    break;
+  case PageAdvice::kSequential:
+    fa.pages = kMaxFaultAroundPages;
+    break;
+  default:
+    fa.pages = page == fa.next_page ?
+      std::min(std::max(fa.pages * 2, min_pages), kMaxFaultAroundPages) : min_pages;
+  }
+  return fa.pages;
+}
+
+// number of pages not mapped yet from page, up to max_pages and below end
+size_t UnmappedPages(uint64_t page, size_t max_pages, uint64_t end) {
+  size_t n = 0;
+  for (; n < max_pages && page + n * kPageSize4K < end; ++n) {
+    if (auto pte = FindPageTableEntry(page + n * kPageSize4K); pte && pte->bits.present) {
+      break;
+    }
+  }
+  return n;
+}
+
+// map the 2 MiB page containing addr if it is inside the region, otherwise
+// up to max_pages 4 KiB pages from addr until a mapped page
+// the 4 KiB pages do not cross a 2 MiB boundary, so that the next 2 MiB of the region
+// can still be mapped with a 2 MiB page
+// the file is loaded to each page before it gets visible to the other threads,
+// return the end of the new pages
+WithError<uint64_t> MapRegionPages(const PagingRegion& r, uint64_t addr, size_t max_pages) {
+  if (auto huge_page = HugePageIn(addr, r.begin, r.end)) {
+    auto fill = [&](void* page) {
+      memset(page, 0, kPageSize2M);
+      if (r.fd) {
+        r.fd->Load(page, kPageSize2M, *huge_page - r.begin);
+      }
+    };
+    if (!SetupHugePage(*huge_page, fill)) {
+      return { *huge_page + kPageSize2M, MAKE_ERROR(Error::kSuccess) };
+    }
+  }
+
+  const uint64_t page = addr & ~(kPageSize4K - 1);
+  const uint64_t block_end = (page | (kPageSize2M - 1)) + 1;
+  const size_t n = UnmappedPages(page, max_pages, std::min(r.end, block_end));
+  if (!r.fd) {
+    if (auto err = SetupPageMaps(LinearAddress4Level{page}, n)) {
+      return { page, err };
+    }
+    return { page + n * kPageSize4K, MAKE_ERROR(Error::kSuccess) };
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    const uint64_t vaddr = page + i * kPageSize4K;
+    auto fill = [&](void* frame) {
+      r.fd->Load(frame, kPageSize4K, vaddr - r.begin);
+    };
+    if (auto err = SetupPage(vaddr, fill)) {
+      return { vaddr, err };
+    }
+  }
+  return { page + n * kPageSize4K, MAKE_ERROR(Error::kSuccess) };
 }
 
 
 } // namespace
 
 WithError<PageMapEntry*> NewPageMap() {
-  auto frame = memory_manager->Allocate(1);
+  // page maps and demand-paged pages must be cleared, take a frame zeroed ahead
+  auto frame = memory_manager->AllocateZeroed();
   if (frame.error) {
     return { nullptr, frame.error };
   }
 
   auto e = reinterpret_cast<PageMapEntry*>(frame.value.Frame());
-  memset(e, 0, sizeof(uint64_t) * 512);
   return { e, MAKE_ERROR(Error::kSuccess)};
 }
 
@@ -192,13 +651,66 @@ Error FreePageMap(PageMapEntry* table) {
   return memory_manager->Free(frame, 1);
 }
 
+Error NewKernelPML4Entry(uint64_t vaddr) {
+  auto pml4_table = CurrentPML4();
+  auto& entry = pml4_table[LinearAddress4Level{vaddr}.Part(4)];
+  auto [ pdp_table, err ] = NewPageMap();
+  if (err) {
+    return err;
+  }
+  entry.SetPointer(pdp_table);
+  entry.bits.present = 1;
+  entry.bits.writable = 1;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error MapKernelPage(uint64_t vaddr) {
+  LinearAddress4Level addr{vaddr};
+  auto table = CurrentPML4();
+  for (int level = 4; level > 1; --level) {
+    auto& entry = table[addr.Part(level)];
+    if (!entry.bits.present) {
+      auto [ child_map, err ] = NewPageMap();
+      if (err) {
+        return err;
+      }
+      entry.SetPointer(child_map);
+      entry.bits.present = 1;
+      entry.bits.writable = 1;
+    }
+    table = entry.Pointer();
+  }
+
+  auto [ frame, err ] = memory_manager->Allocate(1);
+  if (err) {
+    return err;
+  }
+  auto& entry = table[addr.Part(1)];
+  entry.data = 0;
+  entry.SetPointer(reinterpret_cast<PageMapEntry*>(frame.Frame()));
+  entry.bits.present = 1;
+  entry.bits.writable = 1;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error UnmapKernelPage(uint64_t vaddr) {
+  auto pte = FindPageTableEntry(vaddr);
+  if (pte == nullptr || !pte->bits.present || pte->bits.huge_page) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  const FrameID frame{reinterpret_cast<uintptr_t>(pte->Pointer()) / kBytesPerFrame};
+  pte->data = 0;
+  InvalidateTLB(vaddr);
+  return memory_manager->Free(frame, 1);
+}
+
 Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, bool writable) {
-  auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
+  auto pml4_table = CurrentPML4();
   return SetupPageMap(pml4_table, 4, addr, num_4kpages, writable).error;
 }
 
 Error CleanPageMaps(LinearAddress4Level addr) {
-  auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
+  auto pml4_table = CurrentPML4();
   return CleanPageMap(pml4_table, 4, addr);
 }
 
@@ -210,6 +722,7 @@ Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
       }
       dest[i] = src[i];
       dest[i].bits.writable = 0;
+      memory_manager->Ref(FrameOf(src[i]));
     }
     return MAKE_ERROR(Error::kSuccess);
   }
@@ -218,6 +731,13 @@ Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
     if (!src[i].bits.present) {
       continue;
     }
+    if (src[i].bits.huge_page) {
+      // shared until written like 4 KiB pages
+      dest[i] = src[i];
+      dest[i].bits.writable = 0;
+      RefPage(src[i]);
+      continue;
+    }
     auto [ table, err ] = NewPageMap();
     if (err) {
       return err;
@@ -233,20 +753,61 @@ Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
 
 Error HandlePageFault(uint64_t error_code, uint64_t causal_addr) {
   auto& task = task_manager->CurrentTask();
+  task.CountPageFault();
   const bool present = (error_code >> 0) & 1;
   const bool rw      = (error_code >> 1) & 1;
   const bool user    = (error_code >> 2) & 1;
+
+  // another thread of the app may have handled the fault on another CPU
+  // while this CPU waited for the kernel lock (the faulting TLB entry is already flushed)
+  if (auto pte = FindPageTableEntry(causal_addr);
+      pte && pte->bits.present && (!user || pte->bits.user) &&
+      (!present || (rw && pte->bits.writable))) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
   if (present && rw && user) {
     return CopyOnePage(causal_addr);
   } else if (present) {
     return MAKE_ERROR(Error::kAlreadyAllocated);
   }
 
-  if (task.DPagingBegin() <= causal_addr && causal_addr < task.DPagingEnd()) {
-    return SetupPageMaps(LinearAddress4Level{causal_addr}, 1);
+  auto r = FindPagingRegion(task, causal_addr);
+  if (!r) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
   }
-  if (auto m = FindFileMapping(task.FileMaps(), causal_addr)) {
-    return PreparePageCache(*task.Files()[m->fd], *m, causal_addr);
+  // map the neighbouring pages too, so that sequential access does not fault on every page
+  FaultAround& fa = r->fault_around;
+  const uint64_t page = causal_addr & ~(kPageSize4K - 1);
+  const size_t max_pages = FaultAroundPages(fa, page, r->fd ? kFileFaultAroundPages : 1);
+  auto [ mapped_end, err ] = MapRegionPages(*r, causal_addr, max_pages);
+  fa.next_page = mapped_end;
+  return err;
+}
+
+Error AdvisePages(Task& task, uint64_t addr, size_t len, PageAdvice advice) {
+  auto r = FindPagingRegion(task, addr);
+  if (!r || len > r->end - addr) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  if (advice != PageAdvice::kWillNeed) {
+    r->fault_around.advice = advice;
+    return MAKE_ERROR(Error::kSuccess);
   }
-  return MAKE_ERROR(Error::kIndexOutOfRange);
+
+  const uint64_t end = addr + len;
+  uint64_t page = addr & ~(kPageSize4K - 1);
+  while (page < end) {
+    if (auto pte = FindPageTableEntry(page); pte && pte->bits.present) {
+      page = pte->bits.huge_page ? (page | (kPageSize2M - 1)) + 1 : page + kPageSize4K;
+      continue;
+    }
+    const size_t max_pages = (end - page + kPageSize4K - 1) / kPageSize4K;
+    auto [ mapped_end, err ] = MapRegionPages(*r, page, max_pages);
+    if (err) {
+      return err;
+    }
+    page = mapped_end;
+  }
+  return MAKE_ERROR(Error::kSuccess);
 }
\ No newline at end of file
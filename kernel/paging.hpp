@@ -4,12 +4,14 @@
 #include <cstdint>
 
 #include "error.hpp"
+#include "memory_map.hpp"
 
 // create page table of identity mapping (virtual address = physical address)
+// for the physical memory in the memory map, using 1 GiB pages if the CPU supports them
 // set CR3 register
-void SetupIdentityPageTable();
+void SetupIdentityPageTable(const MemoryMap& memory_map);
 
-void InitializePaging();
+void InitializePaging(const MemoryMap& memory_map);
 void ResetCR3();
 
 union LinearAddress4Level {
@@ -74,10 +76,62 @@ union PageMapEntry {
   }  
 };
 
+// PCIDs (process-context identifiers) tag the TLB entries with the address space,
+// so that loading CR3 of an app does not flush the TLB entries of the others
+// CR3 values of the address spaces carry the PCID in bits 11:0 (0: the kernel)
+const uint64_t kCR3PCIDMask = 0xfff;
+
+// set CR4.PCIDE of the running CPU if the CPU supports PCIDs
+// InitializePaging calls it on the BSP, each AP calls it after going to long mode
+void EnablePCID();
+// CR3 value of a new address space of an app with a PCID given to the address space
+uint64_t AddressSpaceCR3(PageMapEntry* pml4);
+// release the PCID of the address space (the page maps are not freed)
+void ReleasePCID(uint64_t cr3);
+// value to load the CR3 value to CR3 of the running CPU: the TLB entries of the PCID
+// are kept unless the CPU may have stale entries of another owner of the PCID
+uint64_t CR3ToLoad(uint64_t cr3);
+// flush the TLB entries of every PCID on the running CPU
+void FlushTLB();
+
+inline PageMapEntry* PML4Of(uint64_t cr3) {
+  return reinterpret_cast<PageMapEntry*>(cr3 & 0x000f'ffff'ffff'f000);
+}
+PageMapEntry* CurrentPML4();
+
+// size of a 2 MiB page, used for large demand-paged and file-mapped regions of apps
+const uint64_t kHugePageBytes = 2 * 1024 * 1024;
+
 WithError<PageMapEntry*> NewPageMap();
 Error FreePageMap(PageMapEntry* table);
 Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages,
                     bool writable = true);
 Error CleanPageMaps(LinearAddress4Level addr);
 Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start);
-Error HandlePageFault(uint64_t error_code, uint64_t causal_addr);
\ No newline at end of file
+Error HandlePageFault(uint64_t error_code, uint64_t causal_addr);
+
+// access pattern of a demand paging region or a file mapping told by SyscallMAdvise
+// the values match MADV_* in apps/syscall.h
+enum class PageAdvice {
+  kNormal = 0,
+  kRandom = 1,     // map only the faulting page
+  kSequential = 2, // map the largest window from the first fault
+  kWillNeed = 3,   // map the pages now (not kept as the advice of the region)
+};
+
+class Task;
+// set the advice of the demand paging region or the file mapping of the app containing
+// [addr, addr + len), or map the pages of the range now for PageAdvice::kWillNeed
+// the task must be running (the pages are mapped to the running address space)
+Error AdvisePages(Task& task, uint64_t addr, size_t len, PageAdvice advice);
+
+// create the PML4 entry of a kernel region in the running address space
+// call it before any address space of an app copies the kernel page map,
+// so that every address space shares the page maps of the region
+Error NewKernelPML4Entry(uint64_t vaddr);
+// map a new frame to the 4 KiB kernel page at vaddr (not accessible from apps)
+// the page maps below the PML4 entry are created if needed
+Error MapKernelPage(uint64_t vaddr);
+// unmap the kernel page and free its frame, the page maps are kept
+// other CPUs may still cache the page, see FlushKernelTLB in smp.hpp
+Error UnmapKernelPage(uint64_t vaddr);
\ No newline at end of file
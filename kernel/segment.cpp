@@ -6,15 +6,16 @@
 #include "interrupt.hpp"
 #include "logger.hpp"
 #include "memory_manager.hpp"
+#include "smp.hpp"
 
 // gdt is never used outside of this file
 namespace {
-  std::array<SegmentDescriptor, 7> gdt;
-  std::array<uint32_t, 26> tss;
+  // a TSS descriptor takes 2 entries in 64 bit mode
+  std::array<SegmentDescriptor, (kTSS >> 3) + 2 * kMaxCPUs> gdt;
+  // every CPU core needs its own TSS to have its own interrupt stacks
+  std::array<std::array<uint32_t, 26>, kMaxCPUs> tss;
 
-  static_assert((kTSS >> 3) + 1 < gdt.size());
-
-  void SetTSS(int index, uint64_t value) {
+  void SetTSS(std::array<uint32_t, 26>& tss, int index, uint64_t value) {
     tss[index]     = value & 0xffffffff;
     tss[index + 1] = value >> 32;
   }
@@ -92,14 +93,24 @@ void InitializeSegmentation() {
   SetCSSS(kKernelCS, kKernelSS);
 }
 
-void InitializeTSS() {
-  SetTSS(1, AllocateStackArea(8));
-  SetTSS(7 + 2 * kISTForTimer, AllocateStackArea(8));
-
-  uint64_t tss_addr = reinterpret_cast<uint64_t>(&tss[0]);
-  SetSystemSegment(gdt[kTSS >> 3], SegmentDescriptorType::kTSSAvailable, 0,
-                   tss_addr & 0xffffffff, sizeof(tss)-1);
-  gdt[(kTSS >> 3) + 1].data = tss_addr >> 32;
+void InitializeAPSegmentation() {
+  LoadGDT(sizeof(gdt) - 1, reinterpret_cast<uintptr_t>(&gdt[0]));
+  SetDSAll(kKernelDS);
+  SetCSSS(kKernelCS, kKernelSS);
+}
 
-  LoadTR(kTSS);
+void InitializeTSS() {
+  const auto cpu = CurrentCPU();
+  auto& cpu_tss = tss[cpu];
+  SetTSS(cpu_tss, 1, AllocateStackArea(8));
+  SetTSS(cpu_tss, 7 + 2 * kISTForTimer, AllocateStackArea(8));
+  SetTSS(cpu_tss, 7 + 2 * kISTForDoubleFault, AllocateStackArea(8));
+
+  const uint16_t tss_sel = kTSS + 16 * cpu;
+  uint64_t tss_addr = reinterpret_cast<uint64_t>(&cpu_tss[0]);
+  SetSystemSegment(gdt[tss_sel >> 3], SegmentDescriptorType::kTSSAvailable, 0,
+                   tss_addr & 0xffffffff, sizeof(cpu_tss)-1);
+  gdt[(tss_sel >> 3) + 1].data = tss_addr >> 32;
+
+  LoadTR(tss_sel);
 }
\ No newline at end of file
@@ -44,9 +44,12 @@ void SetDataSegment(SegmentDescriptor& desc,
 const uint16_t kKernelCS = 1 << 3;
 const uint16_t kKernelSS = 2 << 3;
 const uint16_t kKernelDS = 0;
-const uint16_t kTSS = 5 << 3;
+const uint16_t kTSS = 5 << 3; // TSS of the BSP, each AP uses the next 2 entries
 
 // create and load gdt
 void SetupSegments();
 void InitializeSegmentation();
+// load gdt created by the BSP on an AP
+void InitializeAPSegmentation();
+// set up and load TSS of the running CPU core
 void InitializeTSS();
\ No newline at end of file
@@ -0,0 +1,153 @@
+#include "slab.hpp"
+
+#include <algorithm>
+
+#include "memory_manager.hpp"
+
+namespace {
+  // a slab holds at least this number of objects
+  const size_t kMinObjectsPerSlab = 8;
+
+  SlabCache* first_cache;
+  SlabCache* last_cache;
+
+  size_t AlignUp(size_t value, size_t align) {
+    return (value + align - 1) / align * align;
+  }
+}
+
+SlabCache::SlabCache(const char* name, size_t object_bytes, size_t align)
+    : name_{name} {
+  align = std::max(align, alignof(void*));
+  object_bytes_ = AlignUp(std::max(object_bytes, sizeof(void*)), align);
+  objects_offset_ = AlignUp(sizeof(Slab), align);
+
+  // a power of 2 so that the buddy allocator aligns the slab to its size
+  slab_frames_ = 1;
+  while (slab_frames_ * kBytesPerFrame <
+         objects_offset_ + kMinObjectsPerSlab * object_bytes_) {
+    slab_frames_ *= 2;
+  }
+  objects_per_slab_ = (slab_frames_ * kBytesPerFrame - objects_offset_) / object_bytes_;
+
+  if (last_cache) {
+    last_cache->next_ = this;
+  } else {
+    first_cache = this;
+  }
+  last_cache = this;
+}
+
+WithError<void*> SlabCache::Allocate() {
+  if (partial_ == nullptr) {
+    if (empty_) {
+      PushSlab(partial_, empty_);
+      empty_ = nullptr;
+    } else {
+      auto [ slab, err ] = NewSlab();
+      if (err) {
+        return { nullptr, err };
+      }
+      PushSlab(partial_, slab);
+    }
+  }
+
+  Slab* slab = partial_;
+  void* object = slab->free_objects;
+  slab->free_objects = *reinterpret_cast<void**>(object);
+  ++slab->in_use;
+  ++in_use_;
+  ++allocations_;
+
+  if (slab->free_objects == nullptr) {
+    RemoveSlab(partial_, slab);
+    PushSlab(full_, slab);
+  }
+  return { object, MAKE_ERROR(Error::kSuccess) };
+}
+
+void SlabCache::Free(void* object) {
+  if (object == nullptr) {
+    return;
+  }
+
+  const auto slab_bytes = slab_frames_ * kBytesPerFrame;
+  auto slab = reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(object) & ~(slab_bytes - 1));
+
+  if (slab->free_objects == nullptr) {
+    RemoveSlab(full_, slab);
+    PushSlab(partial_, slab);
+  }
+  *reinterpret_cast<void**>(object) = slab->free_objects;
+  slab->free_objects = object;
+  --slab->in_use;
+  --in_use_;
+
+  if (slab->in_use == 0) {
+    RemoveSlab(partial_, slab);
+    // keep one unused slab so that alternating new and delete does not hit memory_manager
+    if (empty_) {
+      DeleteSlab(slab);
+    } else {
+      empty_ = slab;
+    }
+  }
+}
+
+SlabStat SlabCache::Stat() const {
+  return {
+    name_, object_bytes_, slab_frames_ * kBytesPerFrame, slabs_,
+    in_use_, slabs_ * objects_per_slab_, allocations_,
+  };
+}
+
+WithError<SlabCache::Slab*> SlabCache::NewSlab() {
+  auto [ frame, err ] = memory_manager->Allocate(slab_frames_);
+  if (err) {
+    return { nullptr, err };
+  }
+
+  auto slab = reinterpret_cast<Slab*>(frame.Frame());
+  *slab = Slab{nullptr, nullptr, nullptr, 0};
+
+  // link the objects in address order
+  auto base = reinterpret_cast<uint8_t*>(slab) + objects_offset_;
+  for (size_t i = objects_per_slab_; i > 0; --i) {
+    void* object = base + (i - 1) * object_bytes_;
+    *reinterpret_cast<void**>(object) = slab->free_objects;
+    slab->free_objects = object;
+  }
+
+  ++slabs_;
+  return { slab, MAKE_ERROR(Error::kSuccess) };
+}
+
+void SlabCache::DeleteSlab(Slab* slab) {
+  --slabs_;
+  memory_manager->Free(FrameID{reinterpret_cast<uintptr_t>(slab) / kBytesPerFrame},
+                       slab_frames_);
+}
+
+void SlabCache::PushSlab(Slab*& list, Slab* slab) {
+  slab->prev = nullptr;
+  slab->next = list;
+  if (list) {
+    list->prev = slab;
+  }
+  list = slab;
+}
+
+void SlabCache::RemoveSlab(Slab*& list, Slab* slab) {
+  if (slab->prev) {
+    slab->prev->next = slab->next;
+  } else {
+    list = slab->next;
+  }
+  if (slab->next) {
+    slab->next->prev = slab->prev;
+  }
+}
+
+const SlabCache* SlabCaches() {
+  return first_cache;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "error.hpp"
+
+struct SlabStat {
+  const char* name;
+  size_t object_bytes;
+  size_t slab_bytes;
+  size_t slabs;
+  size_t objects_in_use;
+  size_t objects_total;
+  uint64_t allocations; // number of Allocate calls since the cache was created
+};
+
+// object cache for objects of one size
+// a slab is a naturally aligned block of frames from memory_manager: a header
+// followed by the objects, so Free finds the slab of an object by masking its address
+// freed objects are reused first (LIFO) while their cache lines are likely hot
+class SlabCache {
+  public:
+    SlabCache(const char* name, size_t object_bytes, size_t align);
+
+    WithError<void*> Allocate();
+    void Free(void* object);
+
+    SlabStat Stat() const;
+    // caches are linked in the order of creation
+    const SlabCache* Next() const { return next_; }
+
+  private:
+    struct Slab {
+      Slab* prev;
+      Slab* next;
+      void* free_objects; // linked through the first word of each free object
+      size_t in_use;
+    };
+
+    const char* name_;
+    size_t object_bytes_; // stride of the objects
+    size_t slab_frames_;
+    size_t objects_offset_; // offset of the first object in a slab
+    size_t objects_per_slab_;
+
+    // slabs with free objects, slabs with no free object, and at most one unused slab
+    Slab* partial_{nullptr};
+    Slab* full_{nullptr};
+    Slab* empty_{nullptr};
+    size_t slabs_{0};
+    size_t in_use_{0};
+    uint64_t allocations_{0};
+    SlabCache* next_{nullptr};
+
+    WithError<Slab*> NewSlab();
+    void DeleteSlab(Slab* slab);
+    static void PushSlab(Slab*& list, Slab* slab);
+    static void RemoveSlab(Slab*& list, Slab* slab);
+};
+
+// the first cache (for memstat)
+const SlabCache* SlabCaches();
+
+// cache for the objects of T, created by the first call
+// the kernel does not run global constructors, so the cache is made on demand
+template <class T>
+SlabCache& CacheOf(const char* name) {
+  static SlabCache* cache;
+  if (cache == nullptr) {
+    cache = new SlabCache{name, sizeof(T), alignof(T)};
+  }
+  return *cache;
+}
+
+// for operator new of classes kept in slabs (nullptr if there is no memory)
+template <class T>
+void* SlabNew(const char* name) {
+  return CacheOf<T>(name).Allocate().value;
+}
+
+template <class T>
+void SlabDelete(const char* name, void* object) {
+  CacheOf<T>(name).Free(object);
+}
+
+// allocator for std::allocate_shared and containers
+// single objects come from the cache of T named name, arrays from the heap
+template <class T>
+struct SlabAllocator {
+  using value_type = T;
+
+  const char* name;
+
+  explicit SlabAllocator(const char* name) : name{name} {}
+  template <class U>
+  SlabAllocator(const SlabAllocator<U>& other) : name{other.name} {}
+
+  T* allocate(size_t n) {
+    if (n != 1) {
+      return std::allocator<T>{}.allocate(n);
+    }
+    return static_cast<T*>(SlabNew<T>(name));
+  }
+
+  void deallocate(T* p, size_t n) {
+    if (n != 1) {
+      std::allocator<T>{}.deallocate(p, n);
+      return;
+    }
+    SlabDelete<T>(name, p);
+  }
+
+  template <class U>
+  bool operator==(const SlabAllocator<U>&) const { return true; }
+  template <class U>
+  bool operator!=(const SlabAllocator<U>&) const { return false; }
+};
+
+// std::make_shared with the object and its control block in a slab
+template <class T, class... Args>
+std::shared_ptr<T> MakeSlabShared(const char* name, Args&&... args) {
+  return std::allocate_shared<T>(SlabAllocator<T>{name}, std::forward<Args>(args)...);
+}
@@ -0,0 +1,229 @@
+#include "smp.hpp"
+
+#include <cstring>
+
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "error.hpp"
+#include "fpu.hpp"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "segment.hpp"
+#include "syscall.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+namespace {
+  // the AP startup trampoline is copied here (must be 4 KiB aligned and below 1 MiB)
+  // keep in sync with AP_TRAMPOLINE_BASE in asmfunc.asm
+  const uint64_t kAPTrampolineAddr = 0x8000;
+  const int kAPStackFrames = 8;
+  // the trampoline loads CR4 before long mode, where CR4.PCIDE cannot be set
+  const uint64_t kCR4PCIDE = 1ul << 17;
+
+  volatile uint32_t& lapic_id = *reinterpret_cast<uint32_t*>(0xfee00020);
+  volatile uint32_t& spurious_interrupt_vector = *reinterpret_cast<uint32_t*>(0xfee000f0);
+  volatile uint32_t& icr_low = *reinterpret_cast<uint32_t*>(0xfee00300);
+  volatile uint32_t& icr_high = *reinterpret_cast<uint32_t*>(0xfee00310);
+
+  // parameters passed to the trampoline, the layout must match ApBootParams in asmfunc.asm
+  struct APBootParams {
+    uint64_t cr3, cr0, cr4;
+    uint64_t stack;
+    uint64_t entry;
+    volatile uint32_t started;
+  } __attribute__((packed));
+
+  // key: local APIC ID, value: CPU index
+  // every ID is mapped to the BSP until the APs are registered
+  std::array<uint8_t, 256> cpu_index_of_apic{};
+  // key: CPU index, value: local APIC ID
+  std::array<uint8_t, kMaxCPUs> apic_id_of_cpu{};
+
+  APBootParams& BootParams() {
+    const auto offset = ApBootParams - ApTrampoline;
+    return *reinterpret_cast<APBootParams*>(kAPTrampolineAddr + offset);
+  }
+
+  void SendIPI(uint8_t dest_apic_id, uint32_t icr) {
+    icr_high = static_cast<uint32_t>(dest_apic_id) << 24;
+    icr_low = icr;
+    while (icr_low & (1u << 12)); // wait until the IPI is delivered
+  }
+
+  void ApMain() {
+    InitializeAPSegmentation();
+    LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
+    InitializeFPUForAP();
+    EnablePCID();
+    // the BSP can reuse the trampoline from now on
+    BootParams().started = 1;
+
+    LockKernel();
+    InitializeTSS();
+    InitializeSyscall();
+
+    // APs boot with the local APIC software-disabled
+    spurious_interrupt_vector = spurious_interrupt_vector | 0x100u;
+    Task& idle = task_manager->AddCPU();
+    InitializeLAPICTimerForAP();
+
+    Log(kInfo, "CPU %u (APIC ID %u) started\n", CurrentCPU(), LocalAPICID());
+    __asm__("sti"); // the trampoline started with interrupts disabled
+    TaskIdle(idle.ID(), 0);
+  }
+
+  Error StartAP(uint8_t apic_id, unsigned int cpu) {
+    auto [ stack, err ] = memory_manager->Allocate(kAPStackFrames);
+    if (err) {
+      return err;
+    }
+
+    cpu_index_of_apic[apic_id] = cpu;
+    apic_id_of_cpu[cpu] = apic_id;
+
+    auto& params = BootParams();
+    params.cr3 = reinterpret_cast<uint64_t>(CurrentPML4()); // PCID 0
+    params.cr0 = GetCR0() & ~0x8ul; // clear CR0.TS, the AP has no task yet
+    params.cr4 = GetCR4() & ~kCR4PCIDE;
+    params.stack = reinterpret_cast<uint64_t>(stack.Frame()) + kAPStackFrames * kBytesPerFrame;
+    params.entry = reinterpret_cast<uint64_t>(ApMain);
+    params.started = 0;
+
+    // INIT-SIPI-SIPI sequence
+    SendIPI(apic_id, 0x00004500); // INIT, level assert
+    acpi::WaitMilliseconds(10);
+    for (int i = 0; i < 2 && !params.started; ++i) {
+      SendIPI(apic_id, 0x00004600 | (kAPTrampolineAddr >> 12)); // Startup
+      acpi::WaitMilliseconds(1);
+    }
+    for (int i = 0; i < 100 && !params.started; ++i) {
+      acpi::WaitMilliseconds(1);
+    }
+
+    if (!params.started) {
+      cpu_index_of_apic[apic_id] = 0;
+      memory_manager->Free(stack, kAPStackFrames);
+      return MAKE_ERROR(Error::kNoResponse);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+}
+
+unsigned int num_cpus = 1;
+
+uint8_t LocalAPICID() {
+  // 31:24 of 0xfee00020 is "local APIC ID" of the running CPU core
+  return lapic_id >> 24;
+}
+
+unsigned int CurrentCPU() {
+  return cpu_index_of_apic[LocalAPICID()];
+}
+
+extern "C" std::atomic<uint32_t> kernel_lock{0};
+static_assert(sizeof(kernel_lock) == sizeof(uint32_t)); // accessed from asmfunc.asm
+
+namespace {
+  // incremented by FlushKernelTLB, protected by the kernel lock
+  uint64_t kernel_tlb_generation;
+  std::array<uint64_t, kMaxCPUs> flushed_tlb_generation{};
+
+  // written by ShootdownTLB with the kernel lock held
+  uint64_t shootdown_vaddr;
+  std::array<std::atomic<bool>, kMaxCPUs> shootdown_pending{};
+}
+
+extern "C" bool LockKernel() {
+  const uint32_t me = CurrentCPU() + 1;
+  if (kernel_lock.load(std::memory_order_relaxed) == me) {
+    return false;
+  }
+
+  uint32_t expected = 0;
+  while (!kernel_lock.compare_exchange_weak(expected, me, std::memory_order_acquire)) {
+    expected = 0;
+    // the lock holder may be waiting for this CPU in ShootdownTLB with interrupts disabled
+    HandleTLBShootdown();
+    __asm__("pause");
+  }
+
+  if (flushed_tlb_generation[me - 1] != kernel_tlb_generation) {
+    flushed_tlb_generation[me - 1] = kernel_tlb_generation;
+    FlushTLB(); // kernel pages are not global, so they are cached for each PCID
+  }
+  return true;
+}
+
+extern "C" void UnlockKernel() {
+  const uint32_t me = CurrentCPU() + 1;
+  if (kernel_lock.load(std::memory_order_relaxed) == me) {
+    kernel_lock.store(0, std::memory_order_release);
+  }
+}
+
+void FlushKernelTLB() {
+  // InvalidateTLB flushed only the entries of the running PCID
+  FlushTLB();
+  ++kernel_tlb_generation;
+  flushed_tlb_generation[CurrentCPU()] = kernel_tlb_generation;
+}
+
+void ShootdownTLB(uint32_t cpu_mask, uint64_t vaddr) {
+  shootdown_vaddr = vaddr;
+  for (unsigned int cpu = 0; cpu < num_cpus; ++cpu) {
+    if (cpu_mask & (1u << cpu)) {
+      shootdown_pending[cpu].store(true, std::memory_order_release);
+      SendIPI(apic_id_of_cpu[cpu], 0x00004000 | InterruptVector::kTLBShootdown);
+    }
+  }
+  for (unsigned int cpu = 0; cpu < num_cpus; ++cpu) {
+    while (shootdown_pending[cpu].load(std::memory_order_acquire)) {
+      __asm__("pause");
+    }
+  }
+}
+
+void HandleTLBShootdown() {
+  auto& pending = shootdown_pending[CurrentCPU()];
+  if (pending.load(std::memory_order_acquire)) {
+    InvalidateTLB(shootdown_vaddr);
+    pending.store(false, std::memory_order_release);
+  }
+}
+
+void SendRescheduleIPI(unsigned int cpu) {
+  if (cpu == CurrentCPU()) {
+    // destination shorthand: self
+    SendIPI(0, 0x00044000 | InterruptVector::kReschedule);
+    return;
+  }
+  SendIPI(apic_id_of_cpu[cpu], 0x00004000 | InterruptVector::kReschedule);
+}
+
+void InitializeSMP() {
+  const auto bsp_apic_id = LocalAPICID();
+  apic_id_of_cpu[0] = bsp_apic_id;
+
+  memcpy(reinterpret_cast<void*>(kAPTrampolineAddr), ApTrampoline,
+         ApTrampolineEnd - ApTrampoline);
+
+  for (auto apic_id : acpi::ProcessorLocalAPICIDs()) {
+    if (apic_id == bsp_apic_id) {
+      continue;
+    }
+    if (num_cpus >= kMaxCPUs) {
+      Log(kWarn, "too many CPUs: APIC ID %u is not used\n", apic_id);
+      continue;
+    }
+    if (auto err = StartAP(apic_id, num_cpus)) {
+      Log(kWarn, "failed to start AP (APIC ID %u): %s\n", apic_id, err.Name());
+      continue;
+    }
+    ++num_cpus;
+  }
+
+  Log(kInfo, "%u CPU cores available\n", num_cpus);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// max number of CPU cores the kernel manages (BSP + APs)
+const unsigned int kMaxCPUs = 16;
+
+// number of CPU cores running the kernel (1 until InitializeSMP)
+extern unsigned int num_cpus;
+
+// local APIC ID of the running CPU core
+uint8_t LocalAPICID();
+// index of the running CPU core: 0 is the BSP, 1 .. num_cpus - 1 are the APs
+unsigned int CurrentCPU();
+
+// big kernel lock: only one CPU executes the kernel at a time
+// 0: free, CPU index + 1: held by the CPU
+extern "C" std::atomic<uint32_t> kernel_lock;
+
+// take the kernel lock unless the running CPU already holds it
+// return true if the lock is taken in this call
+extern "C" __attribute__((no_caller_saved_registers)) bool LockKernel();
+// release the kernel lock if the running CPU holds it
+extern "C" void UnlockKernel();
+
+// flush kernel pages unmapped by the running CPU from the TLB of every CPU
+// the other CPUs cannot touch kernel pages without the kernel lock,
+// so they flush their TLB when they take the lock next time
+void FlushKernelTLB();
+
+// invalidate the page at vaddr on the CPUs in cpu_mask (bit n: CPU index n)
+// and wait until all of them have done it; the caller holds the kernel lock
+void ShootdownTLB(uint32_t cpu_mask, uint64_t vaddr);
+// invalidate the page requested by ShootdownTLB if the running CPU is asked to
+void HandleTLBShootdown();
+
+// send InterruptVector::kReschedule to the CPU (may be the running CPU)
+void SendRescheduleIPI(unsigned int cpu);
+
+// boot the application processors listed in MADT
+void InitializeSMP();
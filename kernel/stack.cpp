@@ -0,0 +1,48 @@
+#include "stack.hpp"
+
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+
+namespace {
+  const size_t kGuardPages = 1;
+}
+
+WithError<TaskStack> StackAllocator::Allocate(size_t bytes) {
+  const size_t num_pages = (bytes + kBytesPerFrame - 1) / kBytesPerFrame;
+
+  if (auto it = free_stacks_.find(num_pages); it != free_stacks_.end() && !it->second.empty()) {
+    const uint64_t begin = it->second.back();
+    it->second.pop_back();
+    return { TaskStack{begin, num_pages * kBytesPerFrame}, MAKE_ERROR(Error::kSuccess) };
+  }
+
+  const uint64_t begin = next_ + kGuardPages * kBytesPerFrame;
+  const uint64_t end = begin + num_pages * kBytesPerFrame;
+  if (end > kRegionEnd) {
+    return { {}, MAKE_ERROR(Error::kNoEnoughMemory) };
+  }
+  // a page table allocated halfway is kept for the next stack
+  for (uint64_t vaddr = begin; vaddr < end; vaddr += kBytesPerFrame) {
+    if (auto err = MapKernelPage(vaddr)) {
+      return { {}, err };
+    }
+  }
+  next_ = end;
+  return { TaskStack{begin, num_pages * kBytesPerFrame}, MAKE_ERROR(Error::kSuccess) };
+}
+
+void StackAllocator::Free(const TaskStack& stack) {
+  free_stacks_[stack.bytes / kBytesPerFrame].push_back(stack.begin);
+}
+
+StackAllocator* stack_allocator;
+
+void InitializeStackAllocator() {
+  if (auto err = NewKernelPML4Entry(StackAllocator::kRegionBegin)) {
+    Log(kError, "failed to allocate the page map of kernel stacks: %s\n", err.Name());
+    while (true) __asm__("hlt");
+  }
+
+  stack_allocator = new StackAllocator;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include "error.hpp"
+
+// kernel stack of a task, [begin, begin + bytes) is mapped
+struct TaskStack {
+  uint64_t begin;
+  size_t bytes;
+
+  uint64_t End() const { return begin + bytes; }
+};
+
+// hands out page-aligned kernel stacks from a virtual region shared by every address space
+// the page below each stack is left unmapped, so a stack overflow causes a page fault
+// instead of overwriting other objects
+class StackAllocator {
+  public:
+    // the region covers PML4 entry 1 (512 GiB above the identity mapping)
+    static const uint64_t kRegionBegin = 0x0000'0080'0000'0000;
+    static const uint64_t kRegionEnd = 0x0000'0100'0000'0000;
+
+    // bytes is rounded up to pages
+    WithError<TaskStack> Allocate(size_t bytes);
+    // the stack stays mapped and is reused by the next Allocate of the same size
+    void Free(const TaskStack& stack);
+
+  private:
+    uint64_t next_{kRegionBegin}; // start of the unused part of the region
+    std::map<size_t, std::vector<uint64_t>> free_stacks_{}; // key: number of pages
+};
+
+extern StackAllocator* stack_allocator;
+
+// must be called before any address space of an app copies the kernel page map
+void InitializeStackAllocator();
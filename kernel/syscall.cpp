@@ -16,6 +16,9 @@
 #include "timer.hpp"
 #include "keyboard.hpp"
 #include "app_event.hpp"
+#include "futex.hpp"
+#include "slab.hpp"
+#include "paging.hpp"
 
 namespace syscall {
   struct Result {
@@ -69,7 +72,7 @@ SYSCALL(Exit) {
 SYSCALL(OpenWindow) {
   const int w = arg1, h = arg2, x = arg3, y = arg4;
   const auto title = reinterpret_cast<const char*>(arg5);
-  const auto win = std::make_shared<ToplevelWindow>(
+  const auto win = MakeSlabShared<ToplevelWindow>("ToplevelWindow",
         w, h, screen_config.pixel_format, title);
 
   __asm__("cli");
@@ -210,10 +213,20 @@ SYSCALL(ReadEvent) {
   __asm__("sti");
   size_t i = 0;
 
+  // the cursor blink timer and the window activation stay for the terminal of the app
+  auto is_app_event = [](const Message& m) {
+    return !(m.type == Message::kTimerTimeout && m.arg.timer.value >= 0) &&
+           m.type != Message::kWindowActive;
+  };
+
   while (i < len) {
     __asm__("cli");
-    auto msg = task.ReceiveMessage();
+    auto msg = task.ReceiveMessageIf(is_app_event);
     if (!msg && i == 0) {
+      if (task.Killed()) { // the app is exiting
+        __asm__("sti");
+        return { 0, EINTR };
+      }
       task.Sleep();
       continue;
     }
@@ -267,6 +280,8 @@ SYSCALL(ReadEvent) {
       app_events[i].type = AppEvent::kQuit;
       ++i;
       break;
+    case Message::kLayerFinish:
+      break; // reply to a redraw requested by the terminal
     default:
       Log(kInfo, "uncaught event type: %u\n", msg->type);
     }
@@ -275,6 +290,18 @@ SYSCALL(ReadEvent) {
   return { i, 0 };
 }
 
+namespace {
+  // value * to_freq / from_freq without overflowing the intermediate product
+  // (saturates if the result does not fit in 64 bits)
+  uint64_t ConvertFreq(uint64_t value, uint64_t from_freq, uint64_t to_freq) {
+    if (from_freq >= to_freq && from_freq % to_freq == 0) {
+      return value / (from_freq / to_freq);
+    }
+    const unsigned __int128 v = static_cast<unsigned __int128>(value) * to_freq / from_freq;
+    return v > UINT64_MAX ? UINT64_MAX : static_cast<uint64_t>(v);
+  }
+}
+
 SYSCALL(CreateTimer) {
   const unsigned int mode = arg1;
   const int timer_value = arg2;
@@ -286,15 +313,34 @@ SYSCALL(CreateTimer) {
   const uint64_t task_id = task_manager->CurrentTask().ID();
   __asm__("sti");
 
-  unsigned long timeout = arg3 * kTimerFreq / 1000;
+  // timeout is in msec, or in usec if bit 1 of mode is set
+  const unsigned long unit_freq = (mode & 2) ? 1000000 : 1000;
+  unsigned long timeout = ConvertFreq(arg3, unit_freq, kTimerFreq);
   if (mode & 1) { //relative
-    timeout += timer_manager->CurrentTick();
+    const unsigned long now = timer_manager->CurrentTick();
+    timeout = timeout > UINT64_MAX - now ? UINT64_MAX : timeout + now;
+  }
+
+  __asm__("cli");
+  const auto handle = timer_manager->AddTimer(Timer{timeout, -timer_value, task_id});
+  __asm__("sti");
+  if (mode & 4) { // return the handle for CancelTimer
+    return { handle, 0 };
   }
+  return { ConvertFreq(timeout, kTimerFreq, unit_freq), 0 };
+}
+
+SYSCALL(CancelTimer) {
+  const uint64_t handle = arg1;
 
   __asm__("cli");
-  timer_manager->AddTimer(Timer{timeout, -timer_value, task_id});
+  const uint64_t task_id = task_manager->CurrentTask().ID();
+  const bool canceled = timer_manager->CancelTimer(handle, task_id);
   __asm__("sti");
-  return { timeout * 1000 / kTimerFreq, 0 };
+  if (!canceled) {
+    return { 0, ENOENT };
+  }
+  return { 0, 0 };
 }
 
 namespace {
@@ -370,7 +416,11 @@ SYSCALL(DemandPages) {
   auto& task = task_manager->CurrentTask();
   __asm__("sti");
 
-  const uint64_t dp_end = task.DPagingEnd();
+  uint64_t dp_end = task.DPagingEnd();
+  if (num_pages * 4096 >= kHugePageBytes) {
+    // start at a 2 MiB boundary so that the fault handler can map 2 MiB pages
+    dp_end = (dp_end + kHugePageBytes - 1) & ~(kHugePageBytes - 1);
+  }
   task.SetDPagingEnd(dp_end + 4096 * num_pages);
   return { dp_end, 0 };
 }
@@ -389,19 +439,146 @@ SYSCALL(MapFile) {
 
   *file_size = task.Files()[fd]->Size();
   const uint64_t vaddr_end = task.FileMapEnd();
-  const uint64_t vaddr_begin = (vaddr_end - *file_size) & 0xffff'ffff'ffff'f000;
+  // a large file starts at a 2 MiB boundary so that the fault handler can map 2 MiB pages
+  const uint64_t align = *file_size >= kHugePageBytes ? kHugePageBytes : 4096;
+  const uint64_t vaddr_begin = (vaddr_end - *file_size) & ~(align - 1);
   task.SetFileMapEnd(vaddr_begin);
   task.FileMaps().push_back(FileMapping{fd, vaddr_begin, vaddr_end});
   return { vaddr_begin, 0 };
 }
 
+SYSCALL(ClockGetTime) {
+  return { ClockNanoseconds(), 0 };
+}
+
+SYSCALL(SetNice) {
+  const int nice = arg1;
+
+  __asm__("cli");
+  auto& task = task_manager->CurrentTask();
+  const int old_nice = task.Nice();
+  const auto err = task_manager->SetNice(&task, nice);
+  __asm__("sti");
+  if (err) {
+    return { 0, EINVAL };
+  }
+  return { static_cast<uint64_t>(old_nice), 0 };
+}
+
+SYSCALL(TaskStat) {
+  const auto buf = reinterpret_cast<::TaskStat*>(arg1);
+  const size_t len = arg2;
+
+  __asm__("cli");
+  const auto stats = task_manager->Stat();
+  __asm__("sti");
+
+  const size_t n = std::min(len, stats.size());
+  const size_t bytes = n * sizeof(::TaskStat);
+  if (arg1 < 0x8000'0000'0000'0000 || arg1 + bytes < arg1) {
+    return { 0, EFAULT };
+  }
+  memcpy(buf, stats.data(), bytes);
+  return { n, 0 };
+}
+
+SYSCALL(ThreadCreate) {
+  const uint64_t rip = arg1;
+  const uint64_t arg = arg2;
+  const uint64_t rsp = arg3;
+  if (rip < 0x8000'0000'0000'0000 || rsp < 0x8000'0000'0000'0000) {
+    return { 0, EFAULT };
+  }
+
+  __asm__("cli");
+  Task& thread = task_manager->NewThread(rip, rsp, arg);
+  thread.Wakeup();
+  __asm__("sti");
+  return { thread.ID(), 0 };
+}
+
+SYSCALL(ThreadJoin) {
+  const uint64_t thread_id = arg1;
+
+  __asm__("cli");
+  auto& threads = task_manager->CurrentTask().Group().threads;
+  auto it = std::find(threads.begin(), threads.end(), thread_id);
+  if (it == threads.end()) {
+    __asm__("sti");
+    return { 0, ESRCH }; // not a thread of this app, or joined already
+  }
+  threads.erase(it);
+  auto [ exit_code, err ] = task_manager->WaitFinish(thread_id);
+  __asm__("sti");
+  if (err) {
+    return { 0, EINTR }; // the app is exiting, FinishThreads waits for the thread
+  }
+  return { static_cast<uint64_t>(exit_code), 0 };
+}
+
+SYSCALL(FutexWait) {
+  const auto addr = reinterpret_cast<volatile uint32_t*>(arg1);
+  const uint32_t expected = arg2;
+  if (arg1 < 0x8000'0000'0000'0000 || arg1 % 4) {
+    return { 0, EFAULT };
+  }
+  (void)*addr; // map the page before interrupts are disabled
+
+  __asm__("cli");
+  const auto err = ::FutexWait(addr, expected);
+  __asm__("sti");
+  switch (err.Cause()) {
+  case Error::kValueMismatch: return { 0, EAGAIN };
+  case Error::kInterrupted:   return { 0, EINTR };
+  default:                    return { 0, 0 };
+  }
+}
+
+SYSCALL(FutexWake) {
+  const auto addr = reinterpret_cast<volatile uint32_t*>(arg1);
+  const int n = arg2;
+  if (arg1 < 0x8000'0000'0000'0000 || arg1 % 4) {
+    return { 0, EFAULT };
+  }
+
+  __asm__("cli");
+  const int woken = ::FutexWake(addr, n);
+  __asm__("sti");
+  return { static_cast<uint64_t>(woken), 0 };
+}
+
+SYSCALL(MAdvise) {
+  const uint64_t addr = arg1;
+  const size_t len = arg2;
+  const int advice = arg3;
+  if (advice < 0 || static_cast<int>(PageAdvice::kWillNeed) < advice) {
+    return { 0, EINVAL };
+  }
+
+  __asm__("cli");
+  auto& task = task_manager->CurrentTask();
+  __asm__("sti");
+
+  if (auto err = AdvisePages(task, addr, len, static_cast<PageAdvice>(advice))) {
+    return { 0, err.Cause() == Error::kIndexOutOfRange ? EINVAL : ENOMEM };
+  }
+  return { 0, 0 };
+}
+
+SYSCALL(Yield) {
+  __asm__("cli");
+  task_manager->Yield();
+  __asm__("sti");
+  return { 0, 0 };
+}
+
 #undef SYSCALL
 
 } // namespace syscall
 
 using SyscallFuncType = syscall::Result (uint64_t, uint64_t, uint64_t, 
                                  uint64_t, uint64_t, uint64_t);
-extern "C" std::array<SyscallFuncType*, 0x10> syscall_table{
+extern "C" std::array<SyscallFuncType*, 0x1a> syscall_table{
   /* 0x00 */ syscall::LogString,
   /* 0x01 */ syscall::PutString,
   /* 0x02 */ syscall::Exit,
@@ -418,6 +595,16 @@ extern "C" std::array<SyscallFuncType*, 0x10> syscall_table{
   /* 0x0d */ syscall::ReadFile,
   /* 0x0e */ syscall::DemandPages,
   /* 0x0f */ syscall::MapFile,
+  /* 0x10 */ syscall::ClockGetTime,
+  /* 0x11 */ syscall::CancelTimer,
+  /* 0x12 */ syscall::SetNice,
+  /* 0x13 */ syscall::Yield,
+  /* 0x14 */ syscall::TaskStat,
+  /* 0x15 */ syscall::ThreadCreate,
+  /* 0x16 */ syscall::ThreadJoin,
+  /* 0x17 */ syscall::FutexWait,
+  /* 0x18 */ syscall::FutexWake,
+  /* 0x19 */ syscall::MAdvise,
 };
 
 void InitializeSyscall() {
@@ -1,7 +1,12 @@
 #include "task.hpp"
 
 #include "asmfunc.h"
+#include "graphics.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
 #include "segment.hpp"
+#include "slab.hpp"
 #include "timer.hpp"
 
 namespace {
@@ -10,18 +15,132 @@ namespace {
     auto it = std::remove(c.begin(), c.end(), value);
     c.erase(it, c.end());
   }
-  void TaskIdle(uint64_t task_id, int64_t data) {
-    while (true) __asm__("hlt");
+
+  // weight of each nice value (-20 .. 19), a task gets 1.25 times the CPU time
+  // of a task whose nice value is 1 larger
+  const std::array<unsigned long, Task::kMaxNice - Task::kMinNice + 1> kNiceToWeight{
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+     9548,  7620,  6100,  4904,  3906,
+     3121,  2501,  1991,  1586,  1277,
+     1024,   820,   655,   526,   423,
+      335,   272,   215,   172,   137,
+      110,    87,    70,    56,    45,
+       36,    29,    23,    18,    15,
+  };
+  const unsigned long kNice0Weight = 1024;
+
+  // move vruntime from a queue whose min vruntime is `from` to one whose min is `to`
+  uint64_t RebaseVRuntime(uint64_t vruntime, uint64_t from, uint64_t to) {
+    return to + (vruntime > from ? vruntime - from : 0);
+  }
+
+  Rectangle<int> LayerArea(const Message& msg) {
+    return {{msg.arg.layer.x, msg.arg.layer.y}, {msg.arg.layer.w, msg.arg.layer.h}};
+  }
+
+  // merge msg into the pending message if the pending one can stand for both
+  // return false if they have to be delivered separately
+  bool MergeMessage(Message& pending, const Message& msg) {
+    if (pending.type != msg.type) {
+      return false;
+    }
+
+    if (msg.type == Message::kMouseMove) {
+      auto& p = pending.arg.mouse_move;
+      const auto& m = msg.arg.mouse_move;
+      if (p.buttons != m.buttons) {
+        return false;
+      }
+      p.x = m.x;
+      p.y = m.y;
+      p.dx += m.dx;
+      p.dy += m.dy;
+      return true;
+    }
+
+    if (msg.type == Message::kLayer) {
+      auto& p = pending.arg.layer;
+      const auto& m = msg.arg.layer;
+      auto is_draw = [](LayerOperation op) {
+        return op == LayerOperation::Draw || op == LayerOperation::DrawArea;
+      };
+      // a move must be delivered as is, and a redraw after it must not be merged before it
+      if (pending.src_task != msg.src_task || p.layer_id != m.layer_id ||
+          !is_draw(p.op) || !is_draw(m.op)) {
+        return false;
+      }
+      if (p.op == LayerOperation::Draw || m.op == LayerOperation::Draw) {
+        p.op = LayerOperation::Draw; // the whole layer covers any area
+        return true;
+      }
+      const auto area = LayerArea(pending) | LayerArea(msg);
+      p.x = area.pos.x;
+      p.y = area.pos.y;
+      p.w = area.size.x;
+      p.h = area.size.y;
+      return true;
+    }
+
+    return false;
   }
 }
 
-Task::Task(uint64_t id) : id_{id}, msgs_{} {
+void TaskAppThread(uint64_t task_id, int64_t data) {
+  const auto entry = reinterpret_cast<AppThreadEntry*>(data);
+  const AppThreadEntry e = *entry;
+  delete entry;
+
+  __asm__("cli");
+  Task& task = task_manager->CurrentTask();
+  __asm__("sti");
+  // the app gets arg as argv (the 2nd argument)
+  const int ret = CallApp(0, reinterpret_cast<char**>(e.arg), 3 << 3 | 3, e.rip, e.rsp,
+                          &task.OSStackPointer());
+  __asm__("cli");
+  task_manager->Finish(ret);
 }
 
-Task& Task::InitContext(TaskFunc* f, int64_t data) {
-  const size_t stack_size = kDefaultStackBytes / sizeof(stack_[0]);
-  stack_.resize(stack_size);
-  uint64_t stack_end = reinterpret_cast<uint64_t>(&stack_[stack_size]);
+void TaskIdle(uint64_t task_id, int64_t data) {
+  while (true) {
+    // zero free frames ahead so that page faults do not clear them
+    ZeroFreeFrames();
+    // let other CPUs enter the kernel while this CPU sleeps
+    UnlockKernel();
+    __asm__("hlt");
+  }
+}
+
+Task::Task(uint64_t id)
+    : id_{id}, created_at_{ReadTSC()},
+      group_{MakeSlabShared<ThreadGroup>("ThreadGroup", ThreadGroup{id})} {
+}
+
+void* Task::operator new(size_t bytes) {
+  return SlabNew<Task>("Task");
+}
+
+void Task::operator delete(void* p) {
+  SlabDelete<Task>("Task", p);
+}
+
+Task::~Task() {
+  if (stack_.bytes > 0) {
+    stack_allocator->Free(stack_);
+  }
+}
+
+Task& Task::InitContext(TaskFunc* f, int64_t data, size_t stack_bytes) {
+  if (stack_.bytes > 0) {
+    stack_allocator->Free(stack_);
+  }
+  auto [ stack, err ] = stack_allocator->Allocate(stack_bytes);
+  if (err) {
+    Log(kError, "failed to allocate the stack of task %lu: %s\n", id_, err.Name());
+    while (true) __asm__("hlt");
+  }
+  stack_ = stack;
+  uint64_t stack_end = stack_.End();
 
   memset(&context_, 0, sizeof(context_));
   context_.rip = reinterpret_cast<uint64_t>(f);
@@ -34,7 +153,7 @@ Task& Task::InitContext(TaskFunc* f, int64_t data) {
   context_.ss = kKernelSS;
   context_.rsp = (stack_end & ~0xflu) - 8;
 
-  *reinterpret_cast<uint32_t*>(&context_.fxsave_area[24]) = 0x1f80;
+  *reinterpret_cast<uint32_t*>(&context_.fpu_area[24]) = 0x1f80;
 
   return *this;
 }
@@ -61,75 +180,184 @@ Task& Task::Wakeup() {
   return *this;
 }
 
-void Task::SendMessage(const Message& msg) {
-  msgs_.push_back(msg);
-  Wakeup();
+Error Task::SendMessage(const Message& msg) {
+  // consecutive mouse moves and redraws of the same layer are merged
+  const bool pushed = msgs_.PushOrMerge(msg, MergeMessage);
+  Wakeup(); // let the receiver make room even if the mailbox is full
+  msg_waiters_.WakeupAll();
+  if (!pushed) {
+    return MAKE_ERROR(Error::kFull);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void Task::SendMessageOrWait(const Message& msg) {
+  while (SendMessage(msg)) {
+    // PopMessage wakes up the sender when the mailbox has room
+    full_waiters_.Wait();
+  }
 }
 
 std::optional<Message> Task::ReceiveMessage() {
-  // if there is no message in the queue, return invalid value
-  if (msgs_.empty()) {
-    return std::nullopt;
+  if (!deferred_msgs_.empty()) {
+    const Message m = deferred_msgs_.front();
+    deferred_msgs_.pop_front();
+    return m;
+  }
+  return PopMessage();
+}
+
+void Task::WaitMessage() {
+  if (&task_manager->CurrentTask() == this) {
+    Sleep(); // SendMessage wakes up this task
+  } else {
+    msg_waiters_.Wait();
   }
+}
 
-  auto m = msgs_.front();
-  msgs_.pop_front();
+std::optional<Message> Task::PopMessage() {
+  // if there is no message in the queue, return invalid value
+  auto m = msgs_.Pop();
+  if (m) {
+    full_waiters_.WakeupAll();
+  }
   return m;
 }
 
 std::vector<std::shared_ptr<::FileDescriptor>>& Task::Files() {
-  return files_;
+  return group_->files;
 }
 
 uint64_t Task::DPagingBegin() const {
-  return dpaging_begin_;
+  return group_->dpaging_begin;
 }
 
 void Task::SetDPagingBegin(uint64_t v) {
-  dpaging_begin_ = v;
+  group_->dpaging_begin = v;
 }
 
 uint64_t Task::DPagingEnd() const {
-  return dpaging_end_;
+  return group_->dpaging_end;
 }
 
 void Task::SetDPagingEnd(uint64_t v) {
-  dpaging_end_ = v;
+  group_->dpaging_end = v;
 }
 
 uint64_t Task::FileMapEnd() const {
-  return file_map_end_;
+  return group_->file_map_end;
 }
 
 void Task::SetFileMapEnd(uint64_t v) {
-  file_map_end_ = v;
+  group_->file_map_end = v;
 }
 
 std::vector<FileMapping>& Task::FileMaps() {
-  return file_maps_;
+  return group_->file_maps;
+}
+
+unsigned long Task::Weight() const {
+  return kNiceToWeight[nice_ - kMinNice];
 }
 
 TaskManager::TaskManager() {
   Task& task = NewTask()
-    .SetLevel(current_level_)
-    .SetRunning(true);
-  running_[current_level_].push_back(&task);
+    .SetLevel(kMaxLevel)
+    .SetRunning(true)
+    .SetCPU(0);
+  task.exec_start_ = ReadTSC();
+  current_[0] = &task;
 
   Task& idle = NewTask()
     .InitContext(TaskIdle, 0)
     .SetLevel(0)
     .SetRunning(true);
-  running_[0].push_back(&idle);
+  idle_[0] = &idle;
 }
 
 Task& TaskManager::NewTask() {
-  ++latest_id_;
-  return *tasks_.emplace_back(new Task{latest_id_});
+  if (tasks_.empty()) {
+    // slot 0 is not used so that the main task gets ID 1
+    tasks_.emplace_back();
+    generations_.push_back(0);
+  }
+
+  uint32_t slot;
+  if (free_slots_.empty()) {
+    slot = tasks_.size();
+    tasks_.emplace_back();
+    generations_.push_back(0);
+  } else {
+    slot = free_slots_.back();
+    free_slots_.pop_back();
+    ++generations_[slot];
+  }
+
+  const uint64_t id = (static_cast<uint64_t>(generations_[slot]) << 32) | slot;
+  tasks_[slot].reset(new Task{id});
+  return *tasks_[slot];
 }
 
-void TaskManager::SwitchTask(const TaskContext& current_ctx) {
-  TaskContext& task_ctx = task_manager->CurrentTask().Context();
-  memcpy(&task_ctx, &current_ctx, sizeof(TaskContext));
+Task& TaskManager::AddCPU() {
+  const auto cpu = CurrentCPU();
+  Task& idle = NewTask()
+    .SetLevel(0)
+    .SetRunning(true)
+    .SetCPU(cpu);
+  current_[cpu] = &idle;
+  idle_[cpu] = &idle;
+  return idle;
+}
+
+Task& TaskManager::NewThread(uint64_t rip, uint64_t rsp, uint64_t arg) {
+  Task& current = CurrentTask();
+  Task& thread = NewTask();
+  thread.group_ = current.group_;
+  thread.group_->threads.push_back(thread.ID());
+  thread.SetLevel(current.Level());
+  thread.nice_ = current.nice_;
+
+  auto entry = new AppThreadEntry{rip, (rsp & ~0xflu) - 8, arg};
+  thread.InitContext(TaskAppThread, reinterpret_cast<int64_t>(entry));
+  thread.Context().cr3 = current.Context().cr3;
+  return thread;
+}
+
+void TaskManager::FinishThreads(Task& leader) {
+  auto& group = leader.Group();
+  // threads being joined are not in group.threads, so look for them in all tasks
+  std::vector<uint64_t> ids = group.threads;
+  group.threads.clear();
+  for (const auto& thread : tasks_) {
+    if (!thread || thread.get() == &leader || thread->group_.get() != &group) {
+      continue;
+    }
+    if (std::find(ids.begin(), ids.end(), thread->ID()) == ids.end()) {
+      ids.push_back(thread->ID());
+    }
+    thread->killed_ = true;
+    if (thread->CPU() >= 0) {
+      SendRescheduleIPI(thread->CPU()); // preempt it in the app
+    } else {
+      Wakeup(thread.get()); // a thread sleeping in a syscall sees Killed()
+    }
+  }
+
+  // also clears the exit codes of the threads not joined by the app
+  for (uint64_t id : ids) {
+    WaitFinish(id);
+  }
+}
+
+void TaskManager::SwitchTask(const TaskContext& current_ctx, bool fpu_used) {
+  TaskContext& task_ctx = CurrentTask().Context();
+  memcpy(&task_ctx, &current_ctx, offsetof(TaskContext, fpu_area));
+  if (fpu_used) {
+    memcpy(&task_ctx.fpu_area, &current_ctx.fpu_area, sizeof(task_ctx.fpu_area));
+  }
+  if (CurrentTask().Killed() && (current_ctx.cs & 3)) {
+    Finish(-1); // the thread was interrupted in the app, no kernel state to clean up
+  }
   Task* current_task = RotateCurrentRunQueue(false); // task before switch
   if (&CurrentTask() != current_task) {
     RestoreContext(&CurrentTask().Context());
@@ -143,23 +371,33 @@ void TaskManager::Sleep(Task* task) {
 
   task->SetRunning(false);
 
-  if (task == running_[current_level_].front()) {
+  const auto cpu = CurrentCPU();
+  if (task == current_[cpu]) {
     Task* current_task = RotateCurrentRunQueue(true);
+    if (CurrentTask().Context().cs & 3) {
+      // the next task goes back to the app and the kernel lock is released
+      // before this CPU leaves the stack of current_task
+      switched_from_[cpu] = current_task;
+    } else {
+      current_task->SetCPU(-1);
+    }
     SwitchContext(&CurrentTask().Context(), &current_task->Context());
     return;
   }
 
-  Erase(running_[task->Level()], task);
+  if (task->CPU() < 0) {
+    Erase(running_[task->LastCPU()][task->Level()], task);
+  }
+  // a task executed on another CPU is not queued again at its next switch
 }
 
 Error TaskManager::Sleep(uint64_t id) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                         [id](const auto& t){ return t->ID() == id; });
-  if (it == tasks_.end()) {
+  Task* task = FindTask(id);
+  if (task == nullptr) {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  Sleep(it->get());
+  Sleep(task);
   return MAKE_ERROR(Error::kSuccess);
 }
 
@@ -176,136 +414,340 @@ void TaskManager::Wakeup(Task* task, int level) {
   task->SetLevel(level);
   task->SetRunning(true);
 
-  running_[level].push_back(task);
-  if (level > current_level_) {
-    level_changed_ = true;
+  // a task still on a CPU is queued when the CPU switches from it
+  if (task->CPU() < 0) {
+    // go back to the CPU whose cache may still hold the task
+    const unsigned int cpu = task->LastCPU() < 0 ? CurrentCPU() : task->LastCPU();
+    Enqueue(task, cpu);
+    KickIdleCPU(cpu);
   }
-
-  return;
 }
 
 Error TaskManager::Wakeup(uint64_t id, int level) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                         [id](const auto& t){ return t->ID() == id; });
-  if (it == tasks_.end()) {
+  Task* task = FindTask(id);
+  if (task == nullptr) {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  Wakeup(it->get(), level);
+  Wakeup(task, level);
   return MAKE_ERROR(Error::kSuccess);
 }
 
 Error TaskManager::SendMessage(uint64_t id, const Message& msg) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(), [id](const auto& t){ return t->ID() == id; });
-  if (it == tasks_.end()) {
+  Task* task = FindTask(id);
+  if (task == nullptr) {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  (*it)->SendMessage(msg);
+  return task->SendMessage(msg);
+}
+
+Error TaskManager::SetNice(Task* task, int nice) {
+  if (nice < Task::kMinNice || Task::kMaxNice < nice) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  task->nice_ = nice; // takes effect from the next charge of vruntime
   return MAKE_ERROR(Error::kSuccess);
 }
 
+void TaskManager::Yield() {
+  const auto cpu = CurrentCPU();
+  Task* task = current_[cpu];
+  if (task == idle_[cpu]) {
+    return;
+  }
+
+  // go behind the other tasks of the same level
+  UpdateRuntime(task);
+  for (Task* t : running_[cpu][task->Level()]) {
+    task->vruntime_ = std::max(task->vruntime_, t->vruntime_);
+  }
+
+  Task* current_task = RotateCurrentRunQueue(false);
+  if (&CurrentTask() == current_task) {
+    return;
+  }
+  if (CurrentTask().Context().cs & 3) {
+    // the next task goes back to the app and the kernel lock is released
+    // before this CPU leaves the stack of current_task, so queue it after the switch
+    Erase(running_[cpu][current_task->Level()], current_task);
+    current_task->SetCPU(cpu);
+    switched_from_[cpu] = current_task;
+  }
+  SwitchContext(&CurrentTask().Context(), &current_task->Context());
+}
+
 Task& TaskManager::CurrentTask() {
-  return *running_[current_level_].front();
+  return *current_[CurrentCPU()];
+}
+
+uint32_t TaskManager::OtherCPUsRunning(const ThreadGroup& group) {
+  uint32_t cpu_mask = 0;
+  for (unsigned int cpu = 0; cpu < num_cpus; ++cpu) {
+    if (cpu != CurrentCPU() && current_[cpu] && current_[cpu]->group_.get() == &group) {
+      cpu_mask |= 1u << cpu;
+    }
+  }
+  return cpu_mask;
 }
 
 void TaskManager::Finish(int exit_code) {
   Task* current_task = RotateCurrentRunQueue(true);
 
+  // this CPU still runs on the stack of the task until RestoreContext returns to the next task
+  const auto cpu = CurrentCPU();
+  dead_stacks_[cpu] = current_task->stack_;
+  current_task->stack_ = TaskStack{0, 0};
+
   const auto task_id = current_task->ID();
-  auto it = std::find_if(
-      tasks_.begin(), tasks_.end(),
-      [current_task](const auto& t){ return t.get() == current_task; });
-  tasks_.erase(it);
+  const uint32_t slot = task_id & 0xffffffffu;
+  tasks_[slot].reset();
+  free_slots_.push_back(slot);
   
   finish_tasks_[task_id] = exit_code;
-  if (auto it = finish_waiter_.find(task_id); it != finish_waiter_.end()) {
-    auto waiter = it->second;
-    finish_waiter_.erase(it);
-    Wakeup(waiter);
+  if (auto it = finish_waiters_.find(task_id); it != finish_waiters_.end()) {
+    it->second.queue.WakeupAll();
   }
 
   RestoreContext(&CurrentTask().Context());
 }
 
 WithError<int> TaskManager::WaitFinish(uint64_t task_id) {
-  int exit_code;
-  Task* current_task = &CurrentTask();
-  while (true) {
-    if (auto it = finish_tasks_.find(task_id); it != finish_tasks_.end()) {
-      exit_code = it->second;
-      finish_tasks_.erase(it);
-      break;
+  auto it = finish_tasks_.find(task_id);
+  if (it == finish_tasks_.end()) {
+    Task& waiter = CurrentTask();
+    auto& waiters = finish_waiters_[task_id];
+    ++waiters.num_tasks;
+    // Finish wakes up only the tasks waiting for this task
+    // a killed waiter leaves the exit code to FinishThreads
+    waiters.queue.WaitUntil([&]() {
+      it = finish_tasks_.find(task_id);
+      return waiter.Killed() || it != finish_tasks_.end();
+    });
+    if (--waiters.num_tasks == 0) {
+      finish_waiters_.erase(task_id);
+    }
+    if (waiter.Killed()) {
+      return { 0, MAKE_ERROR(Error::kInterrupted) };
     }
-    finish_waiter_[task_id] = current_task;
-    Sleep(current_task);
   }
+
+  const int exit_code = it->second;
+  finish_tasks_.erase(it);
   return { exit_code, MAKE_ERROR(Error::kSuccess) };
 }
 
+std::vector<TaskStat> TaskManager::Stat() {
+  const uint64_t now = ReadTSC();
+  std::vector<TaskStat> stats;
+  for (const auto& task : tasks_) {
+    if (!task) {
+      continue;
+    }
+
+    uint64_t run_tsc = task->run_tsc_;
+    uint64_t wait_tsc = task->wait_tsc_;
+    if (task->CPU() >= 0) {
+      run_tsc += now - task->exec_start_; // not charged until the task is switched out
+    } else if (task->Running()) {
+      wait_tsc += now - task->queued_at_;
+    }
+
+    stats.push_back(TaskStat{
+      task->ID(), task->Level(), task->Nice(), task->CPU(), task->Running(),
+      TSCToNanoseconds(run_tsc), TSCToNanoseconds(wait_tsc),
+      TSCToNanoseconds(now - task->created_at_), task->switches_,
+      task->MessageCount(), task->MessageOverflows(), task->page_faults_
+    });
+  }
+  return stats;
+}
+
+Task* TaskManager::FindTask(uint64_t id) {
+  const uint64_t slot = id & 0xffffffffu;
+  if (slot >= tasks_.size() || !tasks_[slot] || tasks_[slot]->ID() != id) {
+    return nullptr;
+  }
+  return tasks_[slot].get();
+}
+
 void TaskManager::ChangeLevelRunning(Task* task, int level) {
   if (level < 0 || level == task->Level()) {
     return;
   }
 
-  if (task != running_[current_level_].front()) {
-    // change level of other task
-    Erase(running_[task->Level()], task);
-    running_[level].push_back(task);
-    task->SetLevel(level);
-    if (level > current_level_) {
-      level_changed_ = true;
+  // keep the position of the task relative to the other tasks of the level
+  const auto& min_vruntime = min_vruntime_[std::max(task->LastCPU(), 0)];
+  task->vruntime_ = RebaseVRuntime(task->vruntime_, min_vruntime[task->Level()],
+                                   min_vruntime[level]);
+
+  if (task->CPU() < 0) {
+    // change level of a task waiting in the queue
+    Erase(running_[task->LastCPU()][task->Level()], task);
+    running_[task->LastCPU()][level].push_back(task);
+  }
+  // a task on a CPU is queued to the new level at its next switch
+  task->SetLevel(level);
+}
+
+Task* TaskManager::RotateCurrentRunQueue(bool current_sleep) {
+  const auto cpu = CurrentCPU();
+  ReleaseSwitchedTask(cpu);
+  if (dead_stacks_[cpu].bytes > 0) {
+    stack_allocator->Free(dead_stacks_[cpu]);
+    dead_stacks_[cpu] = TaskStack{0, 0};
+  }
+
+  Task* current_task = current_[cpu];
+  UpdateRuntime(current_task);
+  if (!current_sleep) {
+    current_task->SetCPU(-1);
+    if (current_task != idle_[cpu] && current_task->Running()) {
+      Enqueue(current_task, cpu);
     }
+  }
+
+  Task* next_task = PopNextTask(cpu);
+  if (next_task == nullptr) {
+    next_task = StealTask(cpu);
+  }
+  if (next_task == nullptr) {
+    next_task = idle_[cpu];
+  }
+
+  const uint64_t now = ReadTSC();
+  if (next_task != current_task) {
+    ++next_task->switches_;
+    // loaded by SwitchContext or RestoreContext
+    next_task->context_.cr3 = CR3ToLoad(next_task->context_.cr3);
+  }
+  if (next_task != idle_[cpu]) {
+    next_task->wait_tsc_ += now - next_task->queued_at_;
+  }
+  next_task->SetCPU(cpu).SetLastCPU(cpu);
+  next_task->exec_start_ = now;
+  current_[cpu] = next_task;
+  StartTimeSlice(next_task == idle_[cpu] ? 0 : TimeSlice(next_task, cpu));
+  return current_task;
+}
+
+void TaskManager::ReleaseSwitchedTask(unsigned int cpu) {
+  Task* task = switched_from_[cpu];
+  if (task == nullptr) {
     return;
   }
 
-  // change level of myself
-  running_[current_level_].pop_front();
-  running_[level].push_front(task);
-  task->SetLevel(level);
-  if (level >= current_level_) {
-    current_level_ = level;
-  } else {
-    current_level_ = level;
-    level_changed_ = true;
+  switched_from_[cpu] = nullptr;
+  task->SetCPU(-1);
+  if (task->Running()) { // woken up while this CPU was leaving it
+    Enqueue(task, cpu);
   }
 }
 
-Task* TaskManager::RotateCurrentRunQueue(bool current_sleep) {
-  auto& level_queue = running_[current_level_];
-  Task* current_task = level_queue.front();
-  level_queue.pop_front();
-  if (!current_sleep) {
-    level_queue.push_back(current_task);
+void TaskManager::KickIdleCPU(unsigned int cpu) {
+  // an idle CPU sleeps until an interrupt comes
+  if (current_[cpu] == idle_[cpu]) {
+    SendRescheduleIPI(cpu);
+    return;
+  }
+  for (unsigned int i = 0; i < num_cpus; ++i) {
+    if (current_[i] == idle_[i]) {
+      SendRescheduleIPI(i); // steals the task
+      return;
+    }
   }
-  if (level_queue.empty()) {
-    level_changed_ = true;
+}
+
+void TaskManager::Enqueue(Task* task, unsigned int cpu) {
+  // a task woken up after a long sleep gets at most half a period of credit,
+  // otherwise it would monopolize the CPU until its vruntime catches up
+  const uint64_t min_vruntime = min_vruntime_[cpu][task->Level()];
+  const uint64_t credit = tsc_freq * kSchedLatency / kTimerFreq / 2;
+  if (min_vruntime > credit) {
+    task->vruntime_ = std::max(task->vruntime_, min_vruntime - credit);
   }
 
-  if (level_changed_) {
-    level_changed_ = false;
-    for (int lv = kMaxLevel; lv >= 0; --lv) {
-      if (!running_[lv].empty()) {
-        current_level_ = lv;
-        break;
+  task->SetLastCPU(cpu);
+  task->queued_at_ = ReadTSC();
+  running_[cpu][task->Level()].push_back(task);
+}
+
+Task* TaskManager::PopNextTask(unsigned int cpu) {
+  for (int lv = kMaxLevel; lv >= 0; --lv) {
+    auto& level_queue = running_[cpu][lv];
+    if (level_queue.empty()) {
+      continue;
+    }
+
+    // queues are short, a linear search is enough
+    // on a tie, the task queued first runs first
+    auto it = std::min_element(level_queue.begin(), level_queue.end(),
+                               [](Task* a, Task* b) { return a->vruntime_ < b->vruntime_; });
+    Task* task = *it;
+    level_queue.erase(it);
+    min_vruntime_[cpu][lv] = std::max(min_vruntime_[cpu][lv], task->vruntime_);
+    return task;
+  }
+  return nullptr;
+}
+
+Task* TaskManager::StealTask(unsigned int cpu) {
+  // take a task of the highest level, from the longest queue of the level
+  for (int lv = kMaxLevel; lv >= 0; --lv) {
+    int victim = -1;
+    for (unsigned int i = 0; i < num_cpus; ++i) {
+      auto& level_queue = running_[i][lv];
+      if (i != cpu && !level_queue.empty() &&
+          (victim < 0 || level_queue.size() > running_[victim][lv].size())) {
+        victim = i;
       }
     }
+    if (victim >= 0) {
+      // the task the owner would run next (see PopNextTask), which is the most behind
+      auto& level_queue = running_[victim][lv];
+      auto it = std::min_element(level_queue.begin(), level_queue.end(),
+                                 [](Task* a, Task* b) { return a->vruntime_ < b->vruntime_; });
+      Task* task = *it;
+      level_queue.erase(it);
+      // vruntime is compared only among the tasks of the same CPU
+      task->vruntime_ = RebaseVRuntime(task->vruntime_, min_vruntime_[victim][lv],
+                                       min_vruntime_[cpu][lv]);
+      return task;
+    }
   }
+  return nullptr;
+}
 
-  return current_task;
+void TaskManager::UpdateRuntime(Task* task) {
+  const uint64_t now = ReadTSC();
+  const uint64_t delta = now - task->exec_start_;
+  task->exec_start_ = now;
+  task->run_tsc_ += delta;
+  if (task != idle_[CurrentCPU()]) {
+    task->vruntime_ += delta * kNice0Weight / task->Weight();
+  }
+}
+
+unsigned long TaskManager::TimeSlice(Task* task, unsigned int cpu) {
+  // the share of the period in proportion to the weight among the tasks of the level
+  unsigned long total_weight = task->Weight();
+  for (Task* t : running_[cpu][task->Level()]) {
+    total_weight += t->Weight();
+  }
+  return std::max(kSchedLatency * task->Weight() / total_weight, kMinTimeSlice);
 }
 
 TaskManager* task_manager;
 
 void InitializeTask() {
   task_manager = new TaskManager;
-
-  __asm__("cli");
-  timer_manager->AddTimer(Timer{timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue, 1});
-  __asm__("sti");
 }
 
 __attribute__((no_caller_saved_registers))
 extern "C" uint64_t GetCurrentTaskOSStackPointer() {
   return task_manager->CurrentTask().OSStackPointer();
+}
+
+extern "C" void* GetCurrentTaskFPUArea() {
+  return task_manager->CurrentTask().Context().fpu_area.data();
 }
\ No newline at end of file
@@ -9,39 +9,103 @@
 
 #include "error.hpp"
 #include "message.hpp"
+#include "mpsc_ring.hpp"
+#include "paging.hpp"
 #include "fat.hpp"
+#include "fpu.hpp"
+#include "smp.hpp"
+#include "stack.hpp"
+#include "task_stat.hpp"
+#include "wait_queue.hpp"
+#include "timer.hpp"
 
 struct TaskContext {
   uint64_t cr3, rip, rflags, reserved1; // offset 0x00
   uint64_t cs, ss, fs, gs; // offset 0x20
   uint64_t rax, rbx, rcx, rdx, rdi, rsi, rsp, rbp; // offset 0x40
   uint64_t r8, r9, r10, r11, r12, r13, r14, r15; // offset 0x80
-  std::array<uint8_t, 512> fxsave_area; // offset 0xc0
+  std::array<uint8_t, kFPUAreaBytes> fpu_area; // offset 0xc0 (fxsave or xsave format)
 } __attribute__((packed));
 
 using TaskFunc = void (uint64_t, int64_t); // task_id, data
 
 class TaskManager;
 
+// fault-around state of a region: the window of pages mapped by a fault grows
+// while each fault hits the page right after the previous window
+struct FaultAround {
+  PageAdvice advice{PageAdvice::kNormal};
+  uint64_t next_page{0}; // end of the pages mapped by the last fault
+  size_t pages{0};       // size of the last window
+};
+
 struct FileMapping {
   int fd;
   uint64_t vaddr_begin, vaddr_end;
+  FaultAround fault_around{};
+};
+
+// resources of an app shared by all threads of the app
+// the threads also share CR3 (set to the context of each thread)
+struct ThreadGroup {
+  uint64_t leader_id; // the task which started the app
+  std::vector<uint64_t> threads{}; // threads created and not joined yet
+  std::vector<std::shared_ptr<::FileDescriptor>> files{};
+  uint64_t dpaging_begin{0}, dpaging_end{0};
+  FaultAround dpaging_fault_around{};
+  uint64_t file_map_end{0};
+  std::vector<FileMapping> file_maps{};
 };
 
 class Task {
   public:
     static const int kDefaultLevel = 1;
     static const size_t kDefaultStackBytes = 8 * 4096;
+    static const size_t kMailboxCapacity = 256;
+    // nice value: -20 = largest share of CPU time, 19 = smallest
+    static const int kMinNice = -20;
+    static const int kMaxNice = 19;
 
     Task(uint64_t id);
-    Task& InitContext(TaskFunc* f, int64_t data);
+    ~Task();
+    // tasks are kept in a slab cache
+    static void* operator new(size_t bytes);
+    static void operator delete(void* p);
+    Task& InitContext(TaskFunc* f, int64_t data, size_t stack_bytes = kDefaultStackBytes);
     TaskContext& Context();
     uint64_t& OSStackPointer();
     uint64_t ID() const;
     Task& Sleep();
     Task& Wakeup();
-    void SendMessage(const Message& msg);
+    // return Error::kFull if the mailbox is full (the message is dropped)
+    Error SendMessage(const Message& msg);
+    // sleep the running task while the mailbox is full (not for interrupt handlers)
+    void SendMessageOrWait(const Message& msg);
     std::optional<Message> ReceiveMessage();
+    // sleep the running task until a message comes to this task
+    // (the running task may be another thread of the app)
+    void WaitMessage();
+    // pop the first message satisfying pred
+    // the messages skipped over stay in the mailbox in order for a later ReceiveMessage
+    template <class Pred>
+    std::optional<Message> ReceiveMessageIf(Pred pred) {
+      for (auto it = deferred_msgs_.begin(); it != deferred_msgs_.end(); ++it) {
+        if (pred(*it)) {
+          const Message m = *it;
+          deferred_msgs_.erase(it);
+          return m;
+        }
+      }
+      while (auto m = PopMessage()) {
+        if (pred(*m)) {
+          return m;
+        }
+        deferred_msgs_.push_back(*m);
+      }
+      return std::nullopt;
+    }
+    uint64_t MessageOverflows() const { return msgs_.Overflows(); }
+    size_t MessageCount() const { return deferred_msgs_.size() + msgs_.Size(); }
     std::vector<std::shared_ptr<::FileDescriptor>>& Files();
     uint64_t DPagingBegin() const;
     void SetDPagingBegin(uint64_t v);
@@ -50,60 +114,147 @@ class Task {
     uint64_t FileMapEnd() const;
     void SetFileMapEnd(uint64_t v);
     std::vector<FileMapping>& FileMaps();
+    ThreadGroup& Group() { return *group_; }
+    // the app is exiting, the thread finishes at its next switch in user mode
+    bool Killed() const { return killed_; }
 
     int Level() const { return level_; };
+    int Nice() const { return nice_; };
+    // CPU time weighted by the nice value, in TSC cycles of a nice 0 task
+    uint64_t VRuntime() const { return vruntime_; };
     bool Running() const { return running_; };
+    // index of the CPU core executing this task, -1 if the task is not on any CPU
+    int CPU() const { return cpu_; };
+    // index of the CPU core the task ran on last (-1 if never), the task waits in its run queue
+    int LastCPU() const { return last_cpu_; };
+    void CountPageFault() { ++page_faults_; }
 
   private:
     uint64_t id_;
-    std::vector<uint64_t> stack_;
-    alignas(16) TaskContext context_;
+    TaskStack stack_{0, 0};
+    alignas(64) TaskContext context_;
     uint64_t os_stack_ptr_;
-    std::deque<Message> msgs_;
+    MPSCRing<Message, kMailboxCapacity> msgs_;
+    std::deque<Message> deferred_msgs_{}; // received from msgs_ but skipped by ReceiveMessageIf
+    WaitQueue full_waiters_{}; // tasks waiting for room in msgs_
+    WaitQueue msg_waiters_{}; // tasks other than this waiting for a message in msgs_
     unsigned int level_{kDefaultLevel};
+    int nice_{0};
+    uint64_t vruntime_{0};
+    uint64_t exec_start_{0}; // TSC when the task was switched in
+    // CPU accounting in TSC cycles
+    uint64_t created_at_;
+    uint64_t queued_at_{0};
+    uint64_t run_tsc_{0}, wait_tsc_{0};
+    uint64_t switches_{0};
+    uint64_t page_faults_{0};
     bool running_{false};
-    std::vector<std::shared_ptr<::FileDescriptor>> files_{};
-    uint64_t dpaging_begin_{0}, dpaging_end_{0};
-    uint64_t file_map_end_{0};
-    std::vector<FileMapping> file_maps_{};
+    int cpu_{-1};
+    int last_cpu_{-1};
+    std::shared_ptr<ThreadGroup> group_;
+    bool killed_{false};
 
     Task& SetLevel(int level) { level_ = level; return *this; }
     Task& SetRunning(bool running) { running_ = running; return *this; }
+    Task& SetCPU(int cpu) { cpu_ = cpu; return *this; }
+    Task& SetLastCPU(int cpu) { last_cpu_ = cpu; return *this; }
+    unsigned long Weight() const;
+    std::optional<Message> PopMessage();
 
-    friend TaskManager; // let TaskManager use SetLevel & SetRunning
+    // let TaskManager use SetLevel, SetRunning, SetCPU, SetLastCPU, the scheduling and
+    // accounting fields, stack_, group_ & killed_
+    friend TaskManager;
 };
 
 class TaskManager {
   public:
     // level: 0 = lowest, kMaxLevel = highest
+    // tasks of a higher level always run first, tasks of the same level share the CPU
+    // in proportion to their weights (the task with the least vruntime runs next)
     static const int kMaxLevel = 3;
+    // every runnable task of a level runs once in this period (ticks) ...
+    static constexpr unsigned long kSchedLatency = kTaskTimerPeriod;
+    // ... unless the time slice gets shorter than this
+    static constexpr unsigned long kMinTimeSlice = kTimerFreq / 1000 * 2;
 
     TaskManager();
     Task& NewTask();
-    void SwitchTask(const TaskContext& current_ctx);
+    // create a thread of the app running on the current task
+    // it enters the app at rip with rsp, and gets arg as the 2nd argument
+    Task& NewThread(uint64_t rip, uint64_t rsp, uint64_t arg);
+    // finish the other threads of the app and wait for them (called when the app exits)
+    void FinishThreads(Task& leader);
+    // register the context running on an AP as the idle task of the CPU
+    Task& AddCPU();
+    // fpu_used: the FPU state in current_ctx is valid (the task has used the FPU)
+    void SwitchTask(const TaskContext& current_ctx, bool fpu_used);
 
     void Sleep(Task* task);
     Error Sleep(uint64_t id);
     void Wakeup(Task* task, int level = -1);
     Error Wakeup(uint64_t id, int level = -1);
     Error SendMessage(uint64_t id, const Message& msg);
+    Error SetNice(Task* task, int nice);
+    // give the rest of the time slice to the other tasks of the same level
+    void Yield();
     Task& CurrentTask();
+    // CPUs other than the running one executing a thread of the group (bit n: CPU index n)
+    uint32_t OtherCPUsRunning(const ThreadGroup& group);
     void Finish(int exit_code);
+    // fails with kInterrupted if the waiting task is killed before task_id finishes
     WithError<int> WaitFinish(uint64_t task_id);
+    // CPU usage of all tasks (including the idle tasks) in the order of slots
+    std::vector<TaskStat> Stat();
 
   private:
+    // a task ID is (generation << 32) | slot, the slot is the index of tasks_
+    // the generation is counted up when a slot is reused, so stale IDs don't match
     std::vector<std::unique_ptr<Task>> tasks_{};
-    uint64_t latest_id_{0};
-    std::array<std::deque<Task*>, kMaxLevel + 1> running_{};
-    int current_level_{kMaxLevel};
-    bool level_changed_{false};
+    std::vector<uint32_t> generations_{};
+    std::vector<uint32_t> free_slots_{};
+    using RunQueue = std::array<std::deque<Task*>, kMaxLevel + 1>;
+
+    // runnable tasks waiting for each CPU (tasks executed on a CPU are not in the queues)
+    // a CPU with no task to run steals one from the other CPUs
+    std::array<RunQueue, kMaxCPUs> running_{};
+    std::array<Task*, kMaxCPUs> current_{}; // task executed on each CPU
+    std::array<Task*, kMaxCPUs> idle_{}; // idle task of each CPU (never in running_)
+    // task which went to sleep on each CPU and whose stack may still be in use
+    std::array<Task*, kMaxCPUs> switched_from_{};
+    // stack of the task which finished on each CPU, freed when the CPU leaves it
+    std::array<TaskStack, kMaxCPUs> dead_stacks_{};
+    // smallest vruntime of the tasks run on each CPU at each level (never decreases)
+    std::array<std::array<uint64_t, kMaxLevel + 1>, kMaxCPUs> min_vruntime_{};
     std::map<uint64_t, int> finish_tasks_{}; // key: ID of a finished task
-    std::map<uint64_t, Task*> finish_waiter_{}; // key: ID of a finished task
+    struct FinishWaiters {
+      WaitQueue queue{};
+      int num_tasks{0}; // tasks in WaitFinish (some may be woken but not running yet)
+    };
+    std::map<uint64_t, FinishWaiters> finish_waiters_{}; // key: ID of a task to be finished
 
+    Task* FindTask(uint64_t id);
     void ChangeLevelRunning(Task* task, int level);
     Task* RotateCurrentRunQueue(bool current_sleep);
+    void ReleaseSwitchedTask(unsigned int cpu);
+    void Enqueue(Task* task, unsigned int cpu);
+    // wake up the CPU to run a task queued to it, or an idle CPU to steal it
+    void KickIdleCPU(unsigned int cpu);
+    Task* PopNextTask(unsigned int cpu);
+    Task* StealTask(unsigned int cpu);
+    // charge the CPU time since the task was switched in to run time and vruntime
+    void UpdateRuntime(Task* task);
+    // length of the time slice of the task (ticks)
+    unsigned long TimeSlice(Task* task, unsigned int cpu);
 };
 
 extern TaskManager* task_manager;
 
-void InitializeTask();
\ No newline at end of file
+void InitializeTask();
+// idle loop of each CPU
+void TaskIdle(uint64_t task_id, int64_t data);
+// data of TaskAppThread
+struct AppThreadEntry {
+  uint64_t rip, rsp, arg;
+};
+// enter the app as a thread created by TaskManager::NewThread
+void TaskAppThread(uint64_t task_id, int64_t data);
\ No newline at end of file
@@ -0,0 +1,29 @@
+#pragma once
+
+#ifdef __cplusplus
+#include <cstdint>
+
+extern "C" {
+#else
+#include <stdint.h>
+#endif
+
+// CPU usage of a task, shared by the kernel and apps (SyscallTaskStat)
+struct TaskStat {
+  uint64_t id;
+  int level;
+  int nice;
+  int cpu; // CPU core executing the task, -1 if none
+  int running; // 1: runnable or executed, 0: sleeping
+  uint64_t run_ns; // time executed on a CPU
+  uint64_t wait_ns; // time waited in a run queue
+  uint64_t life_ns; // time since the task was created
+  uint64_t switches; // number of times the task was switched in
+  uint64_t msgs; // number of messages in the mailbox
+  uint64_t msg_overflows; // number of messages dropped because the mailbox was full
+  uint64_t page_faults; // number of page faults handled for the task
+};
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -1,5 +1,7 @@
 #include "terminal.hpp"
 
+#include <cstdlib>
+
 #include "font.hpp"
 #include "layer.hpp"
 #include "task.hpp"
@@ -11,6 +13,7 @@
 #include "asmfunc.h"
 #include "timer.hpp"
 #include "keyboard.hpp"
+#include "slab.hpp"
 
 #include "logger.hpp"
 
@@ -126,11 +129,11 @@ WithError<PageMapEntry*> SetupPML4(Task& current_task) {
     return pml4;
   }
 
-  const auto current_pml4 = reinterpret_cast<PageMapEntry*>(GetCR3());
+  const auto current_pml4 = CurrentPML4();
   memcpy(pml4.value, current_pml4, 256 * sizeof(uint64_t));
 
-  const auto cr3 = reinterpret_cast<uint64_t>(pml4.value);
-  SetCR3(cr3);
+  const auto cr3 = AddressSpaceCR3(pml4.value);
+  SetCR3(CR3ToLoad(cr3));
   current_task.Context().cr3 = cr3;
   return pml4;
 }
@@ -140,7 +143,16 @@ Error FreePML4(Task& current_task) {
   current_task.Context().cr3 = 0;
   ResetCR3();
 
-  return FreePageMap(reinterpret_cast<PageMapEntry*>(cr3));
+  ReleasePCID(cr3);
+  return FreePageMap(PML4Of(cr3));
+}
+
+// free the pages of the app in the running address space and the address space itself
+Error FreeAppAddressSpace(Task& current_task) {
+  if (auto err = CleanPageMaps(LinearAddress4Level{0xffff'8000'0000'0000})) {
+    return err;
+  }
+  return FreePML4(current_task);
 }
 
 void ListAllEntries(FileDescriptor& fd, uint32_t dir_cluster) {
@@ -180,6 +192,9 @@ WithError<AppLoadInfo> LoadApp(fat::DirectoryEntry& file_entry, Task& task) {
     AppLoadInfo app_load = it->second;
     auto err = CopyPageMaps(temp_pml4, app_load.pml4, 4, 256);
     app_load.pml4 = temp_pml4;
+    if (err) {
+      FreeAppAddressSpace(task);
+    }
     return { app_load, err };
   }
 
@@ -188,23 +203,33 @@ WithError<AppLoadInfo> LoadApp(fat::DirectoryEntry& file_entry, Task& task) {
 
   auto elf_header = reinterpret_cast<Elf64_Ehdr*>(&file_buf[0]);
   if (memcmp(elf_header->e_ident, "\x7f" "ELF", 4) != 0) {
+    FreeAppAddressSpace(task);
     return { {}, MAKE_ERROR(Error::kInvalidFile) };
   }
 
   auto [ last_addr, err_load ] = LoadELF(elf_header);
   if (err_load) {
+    FreeAppAddressSpace(task);
     return { {}, err_load };
   }
 
   AppLoadInfo app_load{last_addr, elf_header->e_entry, temp_pml4};
   app_loads->insert(std::make_pair(&file_entry, app_load));
+  // the address space keeps the loaded app for later runs and is not loaded again
+  ReleasePCID(task.Context().cr3);
 
   if (auto [ pml4, err ] = SetupPML4(task); err) {
+    // the cached address space stays loaded, go back to the kernel one
+    task.Context().cr3 = 0;
+    ResetCR3();
     return { app_load, err };
   } else {
     app_load.pml4 = pml4;
   }
   auto err = CopyPageMaps(app_load.pml4, temp_pml4, 4, 256);
+  if (err) {
+    FreeAppAddressSpace(task);
+  }
   return { app_load, err };
 }
 
@@ -231,6 +256,91 @@ fat::DirectoryEntry* FindCommand(const char* command,
   return FindCommand(command, apps_entry.first->FirstCluster());
 }
 
+// a task made for lookupbench, which finishes as soon as it runs
+void TaskFinishNow(uint64_t task_id, int64_t data) {
+  __asm__("cli");
+  task_manager->Finish(0);
+}
+
+// cost of looking up a task by ID with more and more tasks
+// Sleep(id) of a sleeping task does nothing but the lookup
+void LookupBench(FileDescriptor& out) {
+  const int kLookups = 100000;
+  std::vector<uint64_t> ids;
+  for (size_t num_tasks : {16, 64, 256, 1024}) {
+    __asm__("cli");
+    while (ids.size() < num_tasks) {
+      ids.push_back(task_manager->NewTask().InitContext(TaskFinishNow, 0, 2 * 4096).ID());
+    }
+    const uint64_t start = ReadTSC();
+    for (int i = 0; i < kLookups; ++i) {
+      task_manager->Sleep(ids[i % ids.size()]);
+    }
+    const uint64_t ns = TSCToNanoseconds(ReadTSC() - start);
+    __asm__("sti");
+    const uint64_t ns10 = ns * 10 / kLookups;
+    PrintToFD(out, "%5lu tasks: %lu.%lu ns per lookup\n", num_tasks, ns10 / 10, ns10 % 10);
+  }
+
+  __asm__("cli");
+  for (uint64_t id : ids) {
+    task_manager->Wakeup(id);
+  }
+  for (uint64_t id : ids) {
+    task_manager->WaitFinish(id);
+  }
+  __asm__("sti");
+}
+
+// time to allocate and free num_frames frames as single frames (through the magazines)
+// and as blocks of 8 frames (through the buddy lists), holding 4096 frames at a time
+void FrameBench(FileDescriptor& out, size_t num_frames) {
+  const size_t kBatchFrames = 4096;
+  for (size_t block_frames : {1, 8}) {
+    std::vector<FrameID> blocks;
+    blocks.reserve(kBatchFrames / block_frames);
+    uint64_t alloc_tsc = 0, free_tsc = 0;
+    size_t allocated = 0;
+
+    while (allocated < num_frames) {
+      // interrupts are enabled between the batches, so that IPIs and timers are not held
+      __asm__("cli");
+      const uint64_t start = ReadTSC();
+      for (size_t i = 0; i < kBatchFrames / block_frames; ++i) {
+        auto [ frame, err ] = memory_manager->Allocate(block_frames);
+        if (err) {
+          break;
+        }
+        blocks.push_back(frame);
+      }
+      const uint64_t allocated_at = ReadTSC();
+      for (auto frame : blocks) {
+        memory_manager->Free(frame, block_frames);
+      }
+      free_tsc += ReadTSC() - allocated_at;
+      alloc_tsc += allocated_at - start;
+      __asm__("sti");
+
+      if (blocks.empty()) {
+        break;
+      }
+      allocated += blocks.size() * block_frames;
+      blocks.clear();
+    }
+
+    const size_t num_blocks = allocated / block_frames;
+    if (num_blocks == 0) {
+      PrintToFD(out, "no free frames\n");
+      return;
+    }
+    const uint64_t alloc_ns = TSCToNanoseconds(alloc_tsc);
+    const uint64_t free_ns = TSCToNanoseconds(free_tsc);
+    PrintToFD(out, "%lu frames in blocks of %lu: allocate %lu ms (%lu ns each), "
+              "free %lu ms (%lu ns each)\n", allocated, block_frames,
+              alloc_ns / 1000000, alloc_ns / num_blocks, free_ns / 1000000, free_ns / num_blocks);
+  }
+}
+
 }
 
 std::map<fat::DirectoryEntry*, AppLoadInfo>* app_loads;
@@ -250,7 +360,7 @@ Terminal::Terminal(Task& task, const TerminalDescriptor* term_desc)
   }
 
   if (show_window_) {
-    window_ = std::make_shared<ToplevelWindow>(
+    window_ = MakeSlabShared<ToplevelWindow>("ToplevelWindow",
       kColumns * 8 + 8 + ToplevelWindow::kMarginX,
       kRows * 16 + 8 + ToplevelWindow::kMarginY,
       screen_config.pixel_format,
@@ -399,10 +509,10 @@ void Terminal::ExecuteLine() {
     }
 
     auto& subtask = task_manager->NewTask();
-    pipe_fd = std::make_shared<PipeDescriptor>(subtask);
+    pipe_fd = std::make_shared<PipeDescriptor>();
     auto term_desc = new TerminalDescriptor{
       subcommand, true, false,
-      { pipe_fd, files_[1], files_[2] }
+      { pipe_fd, files_[1], files_[2] }, pipe_fd
     };
     files_[1] = pipe_fd;
 
@@ -472,7 +582,7 @@ void Terminal::ExecuteLine() {
         PrintToFD(*files_[2], "%s is not a directory\n", name);
         exit_code = 1;
       } else {
-        fd = std::make_shared<fat::FileDescriptor>(*file_entry);
+        fd = std::make_unique<fat::FileDescriptor>(*file_entry);
       }
     }
     if (fd) {
@@ -509,6 +619,40 @@ void Terminal::ExecuteLine() {
     PrintToFD(*files_[1], "Phys total: %lu frames (%llu MiB)\n",
         p_stat.total_frames,
         p_stat.total_frames * kBytesPerFrame / 1024 / 1024);
+    PrintToFD(*files_[1], "Phys cache: %lu frames (per-CPU magazines)\n",
+        p_stat.cached_frames);
+    PrintToFD(*files_[1], "Phys zero:  %lu frames (zeroed by the idle tasks)\n",
+        p_stat.zeroed_frames);
+    PrintToFD(*files_[1], "Free blocks:");
+    for (int order = 0; order <= kMaxFrameOrder; ++order) {
+      PrintToFD(*files_[1], " %lu", p_stat.free_blocks[order]);
+    }
+    PrintToFD(*files_[1], " (order 0 .. %d)\n", kMaxFrameOrder);
+    PrintToFD(*files_[1], "Slab cache            obj   slab  slabs   used/total  allocs\n");
+    for (auto cache = SlabCaches(); cache; cache = cache->Next()) {
+      const auto c_stat = cache->Stat();
+      PrintToFD(*files_[1], "%-20s %5lu %6lu %6lu %6lu/%-6lu %lu\n",
+          c_stat.name, c_stat.object_bytes, c_stat.slab_bytes, c_stat.slabs,
+          c_stat.objects_in_use, c_stat.objects_total, c_stat.allocations);
+    }
+  } else if (strcmp(command, "top") == 0) {
+    __asm__("cli");
+    const auto stats = task_manager->Stat();
+    __asm__("sti");
+    // %CPU: share of the time since the task was created
+    PrintToFD(*files_[1], "          ID LV NICE CPU  %%CPU  RUN(ms) WAIT(ms)   SWITCH  MSGS  FAULTS\n");
+    for (const auto& s : stats) {
+      const uint64_t permil = s.life_ns > 0 ? s.run_ns * 1000 / s.life_ns : 0;
+      PrintToFD(*files_[1], "%12lu %2d %4d %3d %3lu.%lu %8lu %8lu %8lu %5lu %7lu%s\n",
+          s.id, s.level, s.nice, s.cpu, permil / 10, permil % 10,
+          s.run_ns / 1000000, s.wait_ns / 1000000, s.switches, s.msgs,
+          s.page_faults, s.running ? "" : " (sleep)");
+    }
+  } else if (strcmp(command, "framebench") == 0) {
+    const size_t num_frames = first_arg ? strtoul(first_arg, nullptr, 0) : 0;
+    FrameBench(*files_[1], num_frames > 0 ? num_frames : 1000000);
+  } else if (strcmp(command, "lookupbench") == 0) {
+    LookupBench(*files_[1]);
   } else if (command[0] != 0) {
     auto file_entry = FindCommand(command);
     if (!file_entry) {
@@ -554,6 +698,7 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry, char* comm
 
   LinearAddress4Level args_frame_addr{0xffff'ffff'ffff'f000};
   if (auto err = SetupPageMaps(args_frame_addr, 1)) {
+    FreeAppAddressSpace(task);
     return { 0, err };
   }
   auto argv = reinterpret_cast<char**>(args_frame_addr.value);
@@ -562,12 +707,14 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry, char* comm
   int argbuf_len = 4096 - sizeof(char**) * argv_len;
   auto argc = MakeArgVector(command, first_arg, argv, argv_len, argbuf, argbuf_len);
   if (argc.error) {
+    FreeAppAddressSpace(task);
     return { 0, argc.error };
   }
 
   const int stack_size = 24 * 4096;
   LinearAddress4Level stack_frame_addr{0xffff'ffff'ffff'f000 - stack_size};
   if (auto err = SetupPageMaps(stack_frame_addr, stack_size / 4096)) {
+    FreeAppAddressSpace(task);
     return { 0, err };
   }
 
@@ -585,14 +732,15 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry, char* comm
                     stack_frame_addr.value + stack_size - 8,
                     &task.OSStackPointer());
 
+  // the threads of the app must be gone before the address space is freed
+  __asm__("cli");
+  task_manager->FinishThreads(task);
+  __asm__("sti");
+
   task.Files().clear();
   task.FileMaps().clear();
 
-  if (auto err = CleanPageMaps(LinearAddress4Level{0xffff'8000'0000'0000})) {
-    return { ret, err };
-  }
-
-  return { ret, FreePML4(task) };
+  return { ret, FreeAppAddressSpace(task) };
 }
 
 void Terminal::Print(char32_t c) {
@@ -704,6 +852,9 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
   }
 
   if (term_desc && term_desc->exit_after_command) {
+    if (term_desc->input_pipe) {
+      term_desc->input_pipe->FinishRead(); // the writer must not wait for this task anymore
+    }
     delete term_desc;
     __asm__("cli");
     task_manager->Finish(terminal->LastExitCode());
@@ -773,11 +924,16 @@ TerminalFileDescriptor::TerminalFileDescriptor(Terminal& term)
 size_t TerminalFileDescriptor::Read(void* buf, size_t len) {
   char* bufc = reinterpret_cast<char*>(buf);
 
+  // other messages (e.g. the cursor blink timer) stay for the terminal
+  auto is_input = [](const Message& m) {
+    return m.type == Message::kKeyPush || m.type == Message::kLayerFinish;
+  };
+
   while(true) {
     __asm__("cli");
-    auto msg = term_.UnderlyingTask().ReceiveMessage();
+    auto msg = term_.UnderlyingTask().ReceiveMessageIf(is_input);
     if (!msg) {
-      term_.UnderlyingTask().Sleep();
+      term_.UnderlyingTask().WaitMessage(); // a thread of the app may read the terminal
       continue;
     }
     __asm__("sti");
@@ -809,67 +965,56 @@ size_t TerminalFileDescriptor::Load(void* buf, size_t len, size_t offset) {
   return 0;
 }
 
-PipeDescriptor::PipeDescriptor(Task& task) : task_{task} {
-}
-
 size_t PipeDescriptor::Read(void* buf, size_t len) {
-  if (len_ > 0) {
-    const size_t copy_bytes = std::min(len_, len);
-    memcpy(buf, data_, copy_bytes);
-    len_ -= copy_bytes;
-    memmove(data_, &data_[copy_bytes], len_);
-    return copy_bytes;
-  }
-
-  if (closed_) {
-    return 0;
-  }
-
-  while (true) {
-    __asm__("cli");
-    auto msg = task_.ReceiveMessage();
-    if (!msg) {
-      task_.Sleep();
-      continue;
-    }
-    __asm__("sti");
-
-    if (msg->type != Message::kPipe) {
-      continue;
-    }
+  auto bufc = reinterpret_cast<char*>(buf);
 
-    if (msg->arg.pipe.len == 0) {
-      closed_ = true;
-      return 0;
-    }
+  __asm__("cli");
+  readers_.WaitUntil([this]() { return len_ > 0 || write_closed_; });
 
-    const size_t copy_bytes = std::min<size_t>(msg->arg.pipe.len, len);
-    memcpy(buf, msg->arg.pipe.data, copy_bytes);
-    len_ = msg->arg.pipe.len - copy_bytes;
-    memcpy(data_, &msg->arg.pipe.data[copy_bytes], len_);
-    return copy_bytes;
+  const size_t copy_bytes = std::min(len_, len);
+  for (size_t i = 0; i < copy_bytes; ++i) {
+    bufc[i] = data_[(head_ + i) % kBufferBytes];
   }
+  head_ = (head_ + copy_bytes) % kBufferBytes;
+  len_ -= copy_bytes;
+  writers_.WakeupAll();
+  __asm__("sti");
+  return copy_bytes;
 }
 
 size_t PipeDescriptor::Write(const void* buf, size_t len) {
   auto bufc = reinterpret_cast<const char*>(buf);
-  Message msg{Message::kPipe};
   size_t sent_bytes = 0;
   while (sent_bytes < len) {
-    msg.arg.pipe.len = std::min(len - sent_bytes, sizeof(msg.arg.pipe.len));
-    memcpy(msg.arg.pipe.data, &bufc[sent_bytes], msg.arg.pipe.len);
-    sent_bytes += msg.arg.pipe.len;
     __asm__("cli");
-    task_.SendMessage(msg);
+    writers_.WaitUntil([this]() { return len_ < kBufferBytes || read_closed_; });
+    if (read_closed_) {
+      __asm__("sti");
+      break;
+    }
+
+    const size_t copy_bytes = std::min(len - sent_bytes, kBufferBytes - len_);
+    for (size_t i = 0; i < copy_bytes; ++i) {
+      data_[(head_ + len_ + i) % kBufferBytes] = bufc[sent_bytes + i];
+    }
+    len_ += copy_bytes;
+    sent_bytes += copy_bytes;
+    readers_.WakeupAll();
     __asm__("sti");
   }
   return len;
 }
 
 void PipeDescriptor::FinishWrite() {
-  Message msg{Message::kPipe};
-  msg.arg.pipe.len = 0;
   __asm__("cli");
-  task_.SendMessage(msg);
+  write_closed_ = true;
+  readers_.WakeupAll();
+  __asm__("sti");
+}
+
+void PipeDescriptor::FinishRead() {
+  __asm__("cli");
+  read_closed_ = true;
+  writers_.WakeupAll();
   __asm__("sti");
 }
\ No newline at end of file
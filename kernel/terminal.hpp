@@ -14,11 +14,14 @@ struct AppLoadInfo {
 
 extern std::map<fat::DirectoryEntry*, AppLoadInfo>* app_loads;
 
+class PipeDescriptor;
+
 struct TerminalDescriptor {
   std::string command_line;
   bool exit_after_command;
   bool show_window;
   std::array<std::shared_ptr<FileDescriptor>, 3> files;
+  std::shared_ptr<PipeDescriptor> input_pipe; // files[0] if it is a pipe, closed at the exit
 };
 
 class Terminal {
@@ -79,17 +82,20 @@ class TerminalFileDescriptor : public FileDescriptor {
 
 class PipeDescriptor : public FileDescriptor {
   public:
-    explicit PipeDescriptor(Task& task);
     size_t Read(void* buf, size_t len) override;
     size_t Write(const void* buf, size_t len) override;
     size_t Size() const override { return 0; }
     size_t Load(void* buf, size_t len, size_t offset) override { return 0; }
 
+    // the reader gets 0 (EOF) after the buffered data is read
     void FinishWrite();
+    // the writer discards the data from now on
+    void FinishRead();
 
   private:
-    Task& task_;
-    char data_[16];
-    size_t len_{0};
-    bool closed_{false};
+    static const size_t kBufferBytes = 1024;
+    std::array<char, kBufferBytes> data_;
+    size_t head_{0}, len_{0}; // data_[head_] is the first byte to read, wraps around
+    bool write_closed_{false}, read_closed_{false};
+    WaitQueue readers_{}, writers_{}; // wait for data, wait for room
 };
\ No newline at end of file
@@ -1,35 +1,140 @@
 #include "timer.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cpuid.h>
+#include <limits>
+
 #include "acpi.hpp"
+#include "asmfunc.h"
 #include "logger.hpp"
 #include "interrupt.hpp"
+#include "smp.hpp"
 #include "task.hpp"
 
 namespace {
   const uint32_t kCountMax = 0xffffffffu;
+  const uint32_t kIA32_TSC_DEADLINE = 0x6e0;
   volatile uint32_t& lvt_timer = *reinterpret_cast<uint32_t*>(0xfee00320);
   volatile uint32_t& initial_count = *reinterpret_cast<uint32_t*>(0xfee00380);
   volatile uint32_t& current_count = *reinterpret_cast<uint32_t*>(0xfee00390);
   volatile uint32_t& divide_config = *reinterpret_cast<uint32_t*>(0xfee003e0);
+
+  const uint64_t kNoDeadline = std::numeric_limits<uint64_t>::max();
+  uint64_t tsc_at_boot;
+  // true: the LAPIC timer fires when TSC reaches IA32_TSC_DEADLINE
+  // false: one-shot mode counting down initial_count
+  bool tsc_deadline_mode = false;
+
+  // end of the time slice of each CPU in TSC, kNoDeadline while the CPU is idle
+  std::array<uint64_t, kMaxCPUs> slice_end{};
+
+  uint64_t TickToTSC(unsigned long tick) {
+    // round up not to fire before the tick
+    return tsc_at_boot +
+      (static_cast<unsigned __int128>(tick) * tsc_freq + kTimerFreq - 1) / kTimerFreq;
+  }
+
+  void ProgramLAPICTimer() {
+    const auto cpu = CurrentCPU();
+
+    uint64_t deadline = slice_end[cpu];
+    if (cpu == 0) {
+      if (const auto timeout = timer_manager->NextTimeout();
+          timeout != std::numeric_limits<unsigned long>::max()) {
+        deadline = std::min(deadline, TickToTSC(timeout));
+      }
+    }
+
+    if (tsc_deadline_mode) {
+      // 0 disarms the timer: sleep until a reschedule IPI comes
+      WriteMSR(kIA32_TSC_DEADLINE, deadline == kNoDeadline ? 0 : deadline);
+      return;
+    }
+
+    if (deadline == kNoDeadline) {
+      initial_count = 0; // sleep until a reschedule IPI comes
+      return;
+    }
+
+    const auto now = ReadTSC();
+    const uint64_t tsc_counts = deadline > now ? deadline - now : 0;
+    const uint64_t count =
+      static_cast<unsigned __int128>(tsc_counts) * lapic_timer_freq / tsc_freq;
+    initial_count = std::clamp<uint64_t>(count, 1, kCountMax);
+  }
+
+  void SetLVTTimer() {
+    divide_config = 0b1011; // 3,1,0 bits : divide configuration, 111 means no division (1:1)
+    if (tsc_deadline_mode) {
+      lvt_timer = (0b100 << 16) | InterruptVector::kLAPICTimer; // TSC-deadline, interrupt enabled
+    } else {
+      lvt_timer = (0b000 << 16) | InterruptVector::kLAPICTimer; // one-shot, interrupt enabled
+    }
+  }
 }
 
 void InitializeLAPICTimer() {
   timer_manager = new TimerManager;
+  tsc_at_boot = ReadTSC();
+
+  unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+  if (__get_cpuid_max(0, nullptr) >= 0x15) {
+    __cpuid(0x15, eax, ebx, ecx, edx);
+  }
+
+  if (eax != 0 && ebx != 0 && ecx != 0) {
+    // ECX is the core crystal clock, which also drives the LAPIC timer
+    // and EBX / EAX is the ratio of TSC to the crystal clock
+    tsc_freq = static_cast<uint64_t>(ecx) * ebx / eax;
+    lapic_timer_freq = ecx;
+  } else {
+    // measure lapic timer & TSC frequency
+    divide_config = 0b1011; // no division (1:1)
+    lvt_timer = 0b001 << 16; // one-shot, interrupt disabled
+
+    StartLAPICTimer();
+    const auto tsc_start = ReadTSC();
+    acpi::WaitMilliseconds(100);
+    const auto elapsed = LAPICTimerElapsed();
+    const auto tsc_end = ReadTSC();
+    StopLAPICTimer();
+
+    lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+    tsc_freq = (tsc_end - tsc_start) * 10;
+  }
+
+  __cpuid(0x80000007, eax, ebx, ecx, edx);
+  if ((edx & (1u << 8)) == 0) {
+    Log(kWarn, "TSC is not invariant, the clock may drift\n");
+  }
+  __cpuid(1, eax, ebx, ecx, edx);
+  tsc_deadline_mode = ecx & (1u << 24);
+  Log(kInfo, "TSC %lu Hz, LAPIC timer %lu Hz, TSC-deadline %d\n",
+      tsc_freq, lapic_timer_freq, tsc_deadline_mode);
+
+  slice_end.fill(kNoDeadline);
+  SetLVTTimer();
+  StartTimeSlice(kTaskTimerPeriod); // for the main task
+}
+
+void InitializeLAPICTimerForAP() {
+  SetLVTTimer();
+  StartTimeSlice(0); // APs start from the idle task
+}
 
-  // measure lapic timer frequency
-  divide_config = 0b1011; // no division (1:1)
-  lvt_timer = 0b001 << 16; // one-shot, interrupt disabled
-  
-  StartLAPICTimer();
-  acpi::WaitMilliseconds(100);
-  const auto elapsed = LAPICTimerElapsed();
-  StopLAPICTimer();
+void StartTimeSlice(unsigned long slice) {
+  slice_end[CurrentCPU()] =
+    slice > 0 ? ReadTSC() + tsc_freq * slice / kTimerFreq : kNoDeadline;
+  ProgramLAPICTimer();
+}
 
-  lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+uint64_t ClockNanoseconds() {
+  return TSCToNanoseconds(ReadTSC() - tsc_at_boot);
+}
 
-  divide_config = 0b1011; // 3,1,0 bits : divide configuration, 111 means no division (1:1)
-  lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer; // periodic, interrupt enabled 
-  initial_count = lapic_timer_freq / kTimerFreq; // start timer at the initialization  
+uint64_t TSCToNanoseconds(uint64_t tsc) {
+  return static_cast<unsigned __int128>(tsc) * 1000000000 / tsc_freq;
 }
 
 void StartLAPICTimer() {
@@ -48,49 +153,186 @@ Timer::Timer(unsigned long timeout, int value, uint64_t task_id) : timeout_{time
 }
 
 TimerManager::TimerManager() {
-  timers_.push(Timer{std::numeric_limits<unsigned long>::max(), 0, 0});
+  for (auto& level : slots_) {
+    level.fill(kNil);
+  }
+  // most timers are re-armed, so the entries are rarely allocated after this
+  entries_.reserve(1024);
 }
 
-void TimerManager::AddTimer(const Timer& timer) {
-  timers_.push(timer);
+uint64_t TimerManager::AddTimer(const Timer& timer) {
+  const bool earliest = timer.Timeout() < NextTimeout();
+
+  uint32_t index;
+  if (free_head_ != kNil) {
+    index = free_head_;
+    free_head_ = entries_[index].next;
+    entries_[index].timer = timer;
+    ++entries_[index].generation;
+  } else {
+    index = entries_.size();
+    entries_.push_back(Entry{timer, kNil, kNil, 0, 0, 0, false});
+  }
+  entries_[index].used = true;
+  Link(index);
+
+  if (earliest) {
+    // the BSP has to wake up earlier than programmed
+    if (CurrentCPU() == 0) {
+      ProgramLAPICTimer();
+    } else {
+      SendRescheduleIPI(0);
+    }
+  }
+  return (static_cast<uint64_t>(entries_[index].generation) << 32) | index;
+}
+
+bool TimerManager::CancelTimer(uint64_t handle, uint64_t task_id) {
+  const uint32_t index = handle & 0xffffffffu;
+  if (index >= entries_.size()) {
+    return false;
+  }
+  const auto& e = entries_[index];
+  if (!e.used || e.generation != (handle >> 32) || e.timer.TaskID() != task_id) {
+    return false;
+  }
+
+  Unlink(index);
+  Free(index);
+  return true;
 }
 
-bool TimerManager::Tick() {
-  ++tick_;
+void TimerManager::Tick() {
+  const auto tick = CurrentTick();
 
-  bool task_timer_timeout = false;
   while (true) {
-    const auto& t = timers_.top();
-    if (t.Timeout() > tick_) {
+    // timers in the level 0 slot of current_ have expired
+    const int slot0 = current_ & (kSlots - 1);
+    uint32_t index = slots_[0][slot0];
+    slots_[0][slot0] = kNil;
+    occupied_[0] &= ~(1ul << slot0);
+    while (index != kNil) {
+      const auto& t = entries_[index].timer;
+      Message m{Message::kTimerTimeout};
+      m.arg.timer.timeout = t.Timeout();
+      m.arg.timer.value = t.Value();
+      task_manager->SendMessage(t.TaskID(), m);
+
+      const auto next = entries_[index].next;
+      Free(index);
+      index = next;
+    }
+
+    const auto next_timeout = NextTimeout();
+    if (next_timeout > tick) {
+      current_ = tick;
       break;
     }
 
-    if (t.Value() == kTaskTimerValue) {
-      task_timer_timeout = true;
-      timers_.pop();
-      timers_.push(Timer{tick_ + kTaskTimerPeriod, kTaskTimerValue, 1});
+    // move the timers of the slots starting at next_timeout to lower levels
+    current_ = next_timeout;
+    for (int level = kLevels - 1; level > 0; --level) {
+      const int shift = kSlotBits * level;
+      if (current_ & ((1ul << shift) - 1)) {
+        continue;
+      }
+      const int slot = (current_ >> shift) & (kSlots - 1);
+      index = slots_[level][slot];
+      slots_[level][slot] = kNil;
+      occupied_[level] &= ~(1ul << slot);
+      while (index != kNil) {
+        const auto next = entries_[index].next;
+        Link(index);
+        index = next;
+      }
+    }
+  }
+}
+
+unsigned long TimerManager::NextTimeout() const {
+  // a timer in a lower level always expires earlier than ones in upper levels
+  for (int level = 0; level < kLevels; ++level) {
+    const int shift = kSlotBits * level;
+    const int index = (current_ >> shift) & (kSlots - 1);
+    // slots before current_ are empty
+    const uint64_t slots = occupied_[level] & (~0ul << index);
+    if (slots == 0) {
       continue;
     }
 
-    Message m{Message::kTimerTimeout};
-    m.arg.timer.timeout = t.Timeout();
-    m.arg.timer.value = t.Value();
-    task_manager->SendMessage(t.TaskID(), m); // 1 is main task
+    const int block_shift = shift + kSlotBits;
+    const unsigned long block = block_shift >= 64 ? 0 : current_ & ~((1ul << block_shift) - 1);
+    return block | (static_cast<unsigned long>(__builtin_ctzl(slots)) << shift);
+  }
+  return std::numeric_limits<unsigned long>::max();
+}
+
+void TimerManager::Link(uint32_t index) {
+  auto& e = entries_[index];
+  // a timer already expired goes to the current slot and fires at the next Tick
+  const auto timeout = std::max(e.timer.Timeout(), current_);
+  const auto diff = timeout ^ current_;
+  const int level = diff == 0 ? 0 : (63 - __builtin_clzl(diff)) / kSlotBits;
+  const int slot = (timeout >> (kSlotBits * level)) & (kSlots - 1);
 
-    timers_.pop();
+  e.level = level;
+  e.slot = slot;
+  e.prev = kNil;
+  e.next = slots_[level][slot];
+  if (e.next != kNil) {
+    entries_[e.next].prev = index;
   }
+  slots_[level][slot] = index;
+  occupied_[level] |= 1ul << slot;
+}
 
-  return task_timer_timeout;
+void TimerManager::Unlink(uint32_t index) {
+  const auto& e = entries_[index];
+  if (e.prev != kNil) {
+    entries_[e.prev].next = e.next;
+  } else {
+    slots_[e.level][e.slot] = e.next;
+  }
+  if (e.next != kNil) {
+    entries_[e.next].prev = e.prev;
+  }
+  if (slots_[e.level][e.slot] == kNil) {
+    occupied_[e.level] &= ~(1ul << e.slot);
+  }
+}
+
+void TimerManager::Free(uint32_t index) {
+  auto& e = entries_[index];
+  e.used = false;
+  e.next = free_head_;
+  free_head_ = index;
+}
+
+unsigned long TimerManager::CurrentTick() const {
+  return static_cast<unsigned __int128>(ReadTSC() - tsc_at_boot) * kTimerFreq / tsc_freq;
 }
 
 TimerManager* timer_manager;
 unsigned long lapic_timer_freq;
+uint64_t tsc_freq;
 
-extern "C" void LAPICTimerOnInterrupt(const TaskContext& ctx_stack) {
-  const bool task_timer_timeout = timer_manager->Tick();
+extern "C" void LAPICTimerOnInterrupt(const TaskContext& ctx_stack, bool fpu_used) {
+  const bool locked = LockKernel();
+  const auto cpu = CurrentCPU();
+  if (cpu == 0) {
+    timer_manager->Tick();
+  }
   NotifyEndOfInterrupt();
 
-  if (task_timer_timeout) {
-    task_manager->SwitchTask(ctx_stack);
+  // the idle task has kNoDeadline and always gives the CPU to a runnable task
+  // a killed thread is finished by SwitchTask
+  if (slice_end[cpu] == kNoDeadline || ReadTSC() >= slice_end[cpu] ||
+      task_manager->CurrentTask().Killed()) {
+    task_manager->SwitchTask(ctx_stack, fpu_used); // reprograms the timer via StartTimeSlice
+  } else {
+    ProgramLAPICTimer();
+  }
+  if (locked) {
+    UnlockKernel();
   }
-}
\ No newline at end of file
+}
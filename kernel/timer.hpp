@@ -1,11 +1,23 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
-#include <queue>
+#include <vector>
 
 #include "message.hpp"
 
+// the LAPIC timer runs in TSC-deadline (or one-shot) mode and is programmed to the earliest of
+// the end of the time slice and (on the BSP) the next timeout of timer_manager
 void InitializeLAPICTimer();
+// set up the one-shot timer of an AP (the BSP measures lapic_timer_freq)
+void InitializeLAPICTimerForAP();
+// start a new time slice on the running CPU and reprogram the timer
+// slice: length of the time slice (ticks), 0 if the CPU switched to the idle task
+void StartTimeSlice(unsigned long slice);
+// monotonic time since the boot, based on TSC
+uint64_t ClockNanoseconds();
+// convert a TSC interval to nanoseconds
+uint64_t TSCToNanoseconds(uint64_t tsc);
 void StartLAPICTimer();
 uint32_t LAPICTimerElapsed();
 void StopLAPICTimer();
@@ -23,25 +35,51 @@ class Timer {
     uint64_t task_id_;
 };
 
-inline bool operator<(const Timer& lhs, const Timer& rhs) {
-  return lhs.Timeout() > rhs.Timeout();
-}
-
 class TimerManager {
   public:
     TimerManager();
-    void AddTimer(const Timer& timer);
-    bool Tick();
-    unsigned long CurrentTick() const { return tick_; };
+    // return a handle to cancel the timer
+    uint64_t AddTimer(const Timer& timer);
+    // return false if the timer has already expired or is not of the task
+    bool CancelTimer(uint64_t handle, uint64_t task_id);
+    // send messages for the expired timers (called on the BSP)
+    void Tick();
+    unsigned long CurrentTick() const;
+    // lower bound of the earliest timeout (max of unsigned long if there is no timer)
+    unsigned long NextTimeout() const;
 
   private:
-    volatile unsigned long tick_{0};
-    std::priority_queue<Timer> timers_{};
+    // hierarchical timing wheel: level L has kSlots slots of kSlots^L ticks
+    // a timer is in the lowest level where its timeout and current_ differ in the slot bits,
+    // and moves to lower levels when current_ reaches the start of its slot
+    static const int kSlotBits = 6;
+    static const int kSlots = 1 << kSlotBits;
+    static const int kLevels = 11; // 66 bits cover any timeout
+    static const uint32_t kNil = 0xffffffffu;
+
+    // a handle is (generation << 32) | index of entries_
+    struct Entry {
+      Timer timer;
+      uint32_t prev, next; // list in a slot, or the free list (next only)
+      uint32_t generation;
+      uint8_t level, slot;
+      bool used;
+    };
+
+    unsigned long current_{0}; // the wheel has processed the timers until this tick
+    std::vector<Entry> entries_{};
+    uint32_t free_head_{kNil};
+    std::array<std::array<uint32_t, kSlots>, kLevels> slots_{}; // head of each slot
+    std::array<uint64_t, kLevels> occupied_{}; // bit map of non-empty slots
+
+    void Link(uint32_t index);
+    void Unlink(uint32_t index);
+    void Free(uint32_t index);
 };
 
 extern TimerManager* timer_manager;
 extern unsigned long lapic_timer_freq;
-const int kTimerFreq = 100;
+extern uint64_t tsc_freq;
+const int kTimerFreq = 1000000; // 1 tick = 1 us
 
 const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
-const int kTaskTimerValue = std::numeric_limits<int>::max();
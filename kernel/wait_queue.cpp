@@ -0,0 +1,31 @@
+#include "wait_queue.hpp"
+
+#include <algorithm>
+
+#include "task.hpp"
+
+bool WaitQueue::Wait() {
+  Task& task = task_manager->CurrentTask();
+  waiters_.push_back(&task);
+  task.Sleep();
+  // still queued if something else woke the task up
+  auto it = std::remove(waiters_.begin(), waiters_.end(), &task);
+  const bool woken = it == waiters_.end();
+  waiters_.erase(it, waiters_.end());
+  return woken;
+}
+
+void WaitQueue::WakeupOne() {
+  if (waiters_.empty()) {
+    return;
+  }
+  Task* task = waiters_.front();
+  waiters_.pop_front();
+  task->Wakeup();
+}
+
+void WaitQueue::WakeupAll() {
+  while (!waiters_.empty()) {
+    WakeupOne();
+  }
+}
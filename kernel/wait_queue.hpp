@@ -0,0 +1,28 @@
+#pragma once
+
+#include <deque>
+
+class Task;
+
+// tasks sleeping until a condition becomes true
+// whoever makes the condition true wakes up only the tasks waiting for it
+// call the member functions with interrupts disabled
+class WaitQueue {
+  public:
+    // sleep the running task until the queue is woken up
+    // the task may also be woken up for another reason, so check the condition again
+    // return true if WakeupOne or WakeupAll of this queue woke the task up
+    bool Wait();
+    template <class Cond>
+    void WaitUntil(Cond cond) {
+      while (!cond()) {
+        Wait();
+      }
+    }
+    void WakeupOne();
+    void WakeupAll();
+    bool Empty() const { return waiters_.empty(); }
+
+  private:
+    std::deque<Task*> waiters_{};
+};